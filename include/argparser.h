@@ -3,7 +3,12 @@ typedef struct
 	char** args;
 	char* train;
 	char* nnue;
+	char* nnueCache;
+	int nnueShared;
+	char* nnueEndgame;
 	char* gaviota;
+	char* evaluate;
+	int threads;
 	int numArgs;
 } Arguments;
 
@@ -0,0 +1 @@
+int evaluateEPD(const char* path, int threads);
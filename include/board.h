@@ -6,6 +6,9 @@
  * castleInfo -> Int that holds the availability of the 4 diff castles
  * enPass -> Index of the pawn that moved 2 sqrs in the last turn, otherwise 0
  * fifty -> 50 move rule counter
+ * pawnKey -> Zobrist hash of the pawns alone, updated with every change of the pawns
+ * psqt -> Material + PST of all the pieces as a packed score (MAKE_SCORE), white positive
+ * phase -> Sum of the PHASE_WEIGHT of the pieces, 24 at the start
  */
 
 typedef struct
@@ -19,6 +22,10 @@ typedef struct
     int castleInfo;
     int enPass;
     int fifty;
+
+    uint64_t pawnKey;
+    int psqt;
+    int phase;
 } Board;
 
 const int textToPiece(char piece);
@@ -1,7 +1,19 @@
+/* Scores with the opening value in the low 16 bits and the endgame one in the high 16 bits,
+ * they can be added and subtracted as a single int
+ */
+#define MAKE_SCORE(op, eg) ((int)((unsigned)(eg) << 16) + (op))
+static inline int scoreOP(const int s) {return (int16_t)(uint16_t)s;}
+static inline int scoreEG(const int s) {return (int16_t)(uint16_t)((unsigned)(s + 0x8000) >> 16);}
+
 void initEval(void);
 __attribute__((hot)) int eval(const Board* b);
 int fastEval(const Board* b);
 int insuffMat(const Board* b);
+void computePsqt(const Board* b, int* psqt, int* phase);
+
+//Material + PST of each piece and square (positive for white), filled by initEval with the current values
+extern int PIECE_SQUARE[2][6][64];
+extern const int PHASE_WEIGHT[6];
 
 extern int V_QUEEN[2];
 extern int V_ROOK[2];
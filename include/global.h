@@ -2,6 +2,7 @@
 #define ENGINE_NAME "NoC 9.20 NNUE"
 
 #include <stdint.h>
+#include <time.h>
 
 #define CHECK_MALLOC(ptr) if (!(ptr)) { fprintf(stderr, "Malloc failed in %s %d\n", __FILE__, __LINE__); \
                             exit(66);};
@@ -71,7 +72,22 @@
 
 #define ONLINE_LAG 0 //50 //To account for lag in milliseconds
 
+//Brings the cache line of addr, so it is ready by the time it is read
+#ifdef USE_PREFETCH
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
 inline static const int min(const int a, const int b) {return a < b? a : b;}
 inline static const int max(const int a, const int b) {return a > b? a : b;}
 
+//Wall time in clock_t units. clock() is cpu time, which runs faster than real time with several threads
+inline static clock_t getTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (clock_t)ts.tv_sec * CLOCKS_PER_SEC + (clock_t)ts.tv_nsec / (1000000000 / CLOCKS_PER_SEC);
+}
+
 extern uint64_t POW2[64];
\ No newline at end of file
@@ -1,5 +1,8 @@
-#define NUM_ENTRIES 0x200000 //2_097_152. Each entry is 56B
-#define MOD_ENTRIES 0x1fffff //NUM_ENTRIES - 1, since it is a pow of 2, mod can be done using & MOD_ENTRIES
+#define DEFAULT_HASH 112 //MB, set with setoption name Hash
+#define MAX_HASH 65536 //MB
+#define CLUSTER_SIZE 4 //Entries per cluster, each cluster is 64B (a cache line)
+#define DEFAULT_EVAL_CACHE 8 //MB, set with setoption name EvalCache
+#define MAX_EVAL_CACHE 1024 //MB
 
 #define COLOR_OFFSET 383 //The first (almost) half of the table is for the black pieces
 #define PIECE_OFFSET 64 //Indeces for all the tiles for each piece, in order k,q,r,b,n,p
@@ -9,12 +12,12 @@
 
 enum{LO, HI, EXACT};
 
-/* Struct to hold the information about a position for the transposition table
+/* Struct to hold the information about a position for the transposition table, unpacked from a TTEntry
  * key -> Hash of the position
  * val -> Evaluation assigned to the position with the search
  * eval -> Actual evaluation (NNUE analysis) of the position
  * depth -> depth at which the entry was created
- * Move -> Best move for that position
+ * Move -> Best move for that position, only piece, from and to are stored (from = -1 if there is none)
  */
 typedef struct
 {
@@ -26,6 +29,24 @@ typedef struct
     Move m;
 } Eval;
 
+/* Entry of the transposition table, 16B
+ * key -> Hash of the position XOR data, a probe only matches if both words belong to the same store
+ * data -> move (16 bits) | val (16) | eval (16) | depth (8) | flag (2) | generation (6)
+ * Both words are accessed atomically (relaxed), so threads share the table without locks
+ */
+typedef struct
+{
+    _Atomic uint64_t key;
+    _Atomic uint64_t data;
+} TTEntry;
+
+/* The entries of a position are all in the same cache line
+ */
+typedef struct
+{
+    TTEntry entry[CLUSTER_SIZE];
+} __attribute__((aligned(64))) Cluster;
+
 /* Struct that holds all the information for a 3fold repetition
  * hashTable -> Array that holds the hashes of the position since the last capture / pawn move
  * index -> Index of the last hash inserted + 1 (to add a hash r.hashTable[r.index++] = ...)
@@ -37,9 +58,19 @@ typedef struct
 } Repetition;
 
 void initializeTable(void);
-void reinitializeTable(void);
+void resizeTable(const int mb, const int numThreads);
+void reinitializeTable(const int numThreads);
+void newSearchTT(void);
+void prefetchTT(const uint64_t hash);
+int probeTT(const uint64_t hash, Eval* e);
+void storeTT(const uint64_t hash, const Move m, const int val, const int eval, const int depth, const int flag);
+void resizeEvalCache(const int mb);
+void clearEvalCache(void);
+int probeEvalCache(const uint64_t hash, int* eval);
+void storeEvalCache(const uint64_t hash, const int eval);
 int isThreeRep(const Repetition* r, const uint64_t hash);
 uint64_t hashPosition(const Board* b);
+uint64_t hashPawns(const Board* b);
 uint64_t makeMoveHash(uint64_t prev, Board* b, const Move m, const History h);
 uint64_t changeTurn(const uint64_t prev);
 
@@ -47,4 +78,9 @@ static inline int isRepetition(const Repetition* rep, const uint64_t hash) {retu
 static inline void addHash(Repetition* rep, uint64_t hash) {rep->hashTable[rep->index++] = hash;}
 static inline void remHash(Repetition* rep) {rep->index--;}
 
-extern Eval* table;
\ No newline at end of file
+extern const uint64_t zobRandom[781];
+
+//The pawn key uses the same numbers as the hash of the position
+static inline uint64_t pawnZobrist(const int color, const int sqr) {return zobRandom[color * COLOR_OFFSET + PAWN * PIECE_OFFSET + sqr];}
+
+extern Cluster* table;
\ No newline at end of file
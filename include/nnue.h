@@ -7,15 +7,28 @@ typedef struct
     int16_t* ftBiases;
     int16_t* ftWeights;
 
-    weight_t weights1[32*512];
-    weight_t weights2[32*32];
-    weight_t outputW[1*32];
+    weight_t* weights1; //By rows, for the regular variant
+    weight_t* weights1Sparse; //By chunks of 4 inputs, for the sparse variant
+    weight_t* weights2;
+    weight_t* outputW;
 
-    int32_t biases1[32];
-    int32_t biases2[32];
-    int32_t outputB[1];
+    int32_t* biases1;
+    int32_t* biases2;
+    int32_t* outputB;
+
+    //Every array is in a single 64 byte aligned block, allocated, mapped from the cache or shared memory, or embedded
+    void* mem;
+    size_t size;
+    int storage;
 } NNUE;
 
+enum
+{
+    NNUE_ALLOCATED,
+    NNUE_MAPPED,
+    NNUE_EMBEDDED
+};
+
 typedef struct
 {
     int piece;
@@ -43,16 +56,85 @@ enum {
     SHIFT = 6,
 };
 
+//Longest line: the search (MAX_PLY), the null move subtree and the quiescence search
+#define ACC_STACK_SIZE (2 * MAX_PLY + 16)
+
+/* The set of networks, the endgame one is optional and evaluates the positions with few pieces
+ */
+enum
+{
+    NNUE_MAIN,
+    NNUE_ENDGAME,
+    NNUE_NETS
+};
+
+/* Accumulators of a position of the current line, one per network. Making a move only records its changes,
+ * the accumulator is computed from the closest computed ancestor when the position is evaluated
+ */
+typedef struct
+{
+    int16_t acc[NNUE_NETS][kDimensionFT];
+    NNUEChangeList list;
+    int computed[NNUE_NETS];
+} NNUEAccumulator;
+
+/* Last accumulator computed for a king square and the pieces it was computed with,
+ * a refresh only has to apply the difference with the current board
+ */
+typedef struct
+{
+    int16_t acc[kHalfDimensionFT];
+    uint64_t piece[2][6];
+} NNUERefreshEntry;
+
+/* One per search thread, stack[top] is the current position
+ * Moves made with the stack full are only counted in overflow, those positions are evaluated from scratch
+ * refresh -> Indexed by perspective and king square
+ * nn -> Networks of the current search, it holds a reference to them (attachNNUE)
+ * endgamePieces -> Positions with at most this many pieces use nn[NNUE_ENDGAME], if it is loaded
+ */
+typedef struct
+{
+    const NNUE* nn[NNUE_NETS];
+    int endgamePieces;
+    NNUEAccumulator stack[ACC_STACK_SIZE];
+    int top;
+    int overflow;
+
+    NNUERefreshEntry refresh[NNUE_NETS][2][64];
+} NNUEStack;
+
+//Implementation of the hidden layers, both are in the binary and the fastest is chosen at startup
+enum
+{
+    VARIANT_AUTO,
+    VARIANT_REGULAR,
+    VARIANT_SPARSE
+};
+
 static const int dimensions[5] = {41024, 512, 32, 32, 1};
 static const unsigned int NNUEVersion = 0x7AF32F16u;
 
-void initNNUE(const char* path);
-NNUE loadNNUE(const char* path);
+int initNNUE(const int net, const char* path, const char* cachePath, const int shared);
+void unloadNNUE(const int net);
+void setEndgamePieces(const int n);
+unsigned nnueGeneration(void);
+int loadNNUE(NNUE* nn, const char* path, const char* cachePath, const int shared);
+void allocNNUE(NNUE* nn);
+int hasEmbeddedNNUE(void);
 void freeNNUE(NNUE* nn);
+const NNUE* acquireNNUE(const int net);
+void releaseNNUE(const NNUE* nn);
+void attachNNUE(NNUEStack* st);
+void detachNNUE(NNUEStack* st);
 void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t* inp);
 void determineChanges(const Move m, NNUEChangeList* list, const int color);
-int evaluateNNUE(const Board* b, const int useAcc);
+int evaluateNNUE(const Board* b, NNUEStack* st);
+void evaluateBatch(NNUEStack* st, const Board* boards, const int n, int* evals);
+int nnueSelfCheck(const int positions);
+void benchNNUE(void);
+void setNNUEVariant(const int v);
 
-void initNNUEAcc(const Board* b);
-void updateDo(NNUEChangeList* q, const Move m, const Board* const b);
-void updateUndo(NNUEChangeList* q, const Board* const b);
\ No newline at end of file
+void initNNUEAcc(const Board* b, NNUEStack* st);
+void updateDo(NNUEStack* st, const Move m, const Board* const b);
+void updateUndo(NNUEStack* st);
\ No newline at end of file
@@ -1,6 +1,9 @@
-const int getIdx(const int i, const int j, const int dim);
+const int getIdxSparse(const int i, const int j, const int dim);
 int evaluateAcc(const NNUE* nn, const Board* const b, const int16_t* nInput);
 int evaluate(const NNUE* nn, const Board* const b, int16_t* nInput);
+int32_t forward(const NNUE* nn, const int16_t* nInput, const int stm, clipped_t* hidden1, clipped_t* hidden2);
+int32_t forwardRegular(const NNUE* nn, const int16_t* nInput, const int stm, clipped_t* hidden1, clipped_t* hidden2);
+int32_t forwardSparse(const NNUE* nn, const int16_t* nInput, const int stm, clipped_t* hidden1, clipped_t* hidden2);
 
 inline static const clipped_t clip64(const int32_t v)
 {
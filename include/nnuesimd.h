@@ -0,0 +1,37 @@
+#define MAX_FT_ROWS 32 //Rows of a single update, a full refresh has at most 30
+
+/* Instruction set of the kernels, chosen at startup with cpuid
+ */
+enum
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_SSSE3,
+    SIMD_AVX2,
+    SIMD_VNNI,
+    SIMD_LEVELS
+};
+
+void initSimd(void);
+int simdLevel(void);
+int simdSupported(const int level);
+int setSimd(const int level);
+const char* simdName(const int level);
+
+/* out = in + sum(add) - sum(sub), every row has kHalfDimensionFT elements. out can be in
+ */
+void ftUpdate(int16_t* out, const int16_t* in, const int16_t* const* add, const int nAdd, const int16_t* const* sub, const int nSub);
+
+/* Clipped ReLU of the accumulator and of the hidden layers, n is a multiple of 32
+ */
+void clipAcc(const int16_t* in, int8_t* out, const int n);
+void clipHidden(const int32_t* in, int8_t* out, const int n);
+
+/* out = bs + ws * in, ws has kDimensionHidden rows of inDim weights. inDim is a multiple of 32
+ */
+void affine(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out);
+
+/* Same as affine but only the chunks of 4 inputs with a nonzero are used. ws is stored by chunks,
+ * the 4 weights of each of the kDimensionHidden outputs: ws[(j/4) * 4*kDimensionHidden + i*4 + j%4]
+ */
+void affineSparse(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out);
@@ -1,9 +1,15 @@
+#define MAX_THREADS 128
+#define DEFAULT_LAZY_MARGIN 1200
+#define DEFAULT_CLASSICAL_PIECES 8
+
 typedef struct
 {
     int depth;
     clock_t timeToMove;
     clock_t extraTime;
     clock_t maxTime;
+    int ponder;
+    int infinite; //The bestmove is only sent after the stop
 
 } SearchParams;
 
@@ -15,5 +21,59 @@ typedef struct
     int consecutiveScore;
 } SearchData;
 
+/* Principal variation, moves[0] is the move played at the node it belongs to
+ */
+typedef struct
+{
+    Move moves[MAX_PLY+2];
+    int length;
+} PV;
+
+/* Everything a thread modifies during the search, the TT is the only shared structure
+ * hs -> Killers and history
+ * accStack -> NNUE accumulators of the current line
+ * moveStack / evalStack -> Move played and static eval at each height
+ * nodes -> Nodes searched by the thread
+ * nnueEvals / lazyEvals -> Evaluations done with the NNUE and the ones the lazy evaluation skipped
+ * evalHits / evalMisses -> Static evaluations found in the eval cache and the ones computed
+ * percentage -> Fraction of the root moves already searched
+ * foundBeforeTimesUp -> Index of the last root move that raised alpha, -1 if none
+ * pv -> Triangular PV table, pv[h] is the line found from height h
+ * best / bestPV / completedDepth -> Result of the last completed iteration
+ * id -> 0 is the main thread, the rest are helpers
+ */
+typedef struct
+{
+    Heuristics hs;
+    NNUEStack accStack;
+
+    Move moveStack[MAX_PLY+10]; //To avoid possible overflow errors
+    int evalStack[MAX_PLY+10];
+
+    uint64_t nodes;
+    uint64_t nnueEvals;
+    uint64_t lazyEvals;
+    uint64_t evalHits;
+    uint64_t evalMisses;
+    double percentage;
+    int foundBeforeTimesUp;
+
+    PV pv[MAX_PLY+2];
+
+    Move best;
+    PV bestPV;
+    int completedDepth;
+    int id;
+} SearchThread;
+
+void setThreads(const int n);
+int getThreads(void);
+uint64_t totalNodes(void);
+void setStop(const int stop);
+void setMultiPV(const int n);
+void setLazyMargin(const int margin);
+void setClassicalPieces(const int n);
+void ponderHit(void);
+Move ponderMove(const Move best);
 Move bestTime(Board b, Repetition rep, SearchParams sp);
-__attribute__((hot)) int qsearch(Board b, int alpha, const int beta, const int d);
\ No newline at end of file
+__attribute__((hot)) int qsearch(SearchThread* td, Board b, int alpha, const int beta, const int d, const uint64_t hash);
@@ -1,13 +1,23 @@
+#define NUM_KM 2
+
+/* Move ordering heuristics, each search thread owns one so that they can be updated without locks
+ * killerMoves -> Quiet moves that produced a cutoff, indexed by [depth][slot]
+ * history -> Bonus of the quiet moves indexed by [color][from*64+to]
+ */
+typedef struct
+{
+    Move killerMoves[MAX_PLY][NUM_KM];
+    int history[2][4096];
+} Heuristics;
+
 void initSort(void);
-void initKM(void);
-void initHistory(void);
-void addKM(const Move m, const int depth);
-void addHistory(const int from, const int to, const int n, const int stm);
-void decHistory(const int from, const int to, const int n, const int stm);
-__attribute__((hot)) void assignScores(Board* b, Move* list, const int numMoves, const Move bestFromPos, const int depth);
+void initKM(Heuristics* hs);
+void initHistory(Heuristics* hs);
+void addKM(Heuristics* hs, const Move m, const int depth);
+void addHistory(Heuristics* hs, const int from, const int to, const int n, const int stm);
+void decHistory(Heuristics* hs, const int from, const int to, const int n, const int stm);
+__attribute__((hot)) void assignScores(const Heuristics* hs, Board* b, Move* list, const int numMoves, const Move bestFromPos, const int depth);
 __attribute__((hot)) void assignScoresQuiesce(Board* b, Move* list, const int numMoves);
 int compMoves(const Move* m1, const Move* m2);
 void sort(Move* start, Move* end);
 void moveToFst(Move* list, int idx);
-
-extern int history[2][4096];
\ No newline at end of file
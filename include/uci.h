@@ -1,2 +1,2 @@
 void loop(void);
-void infoString(const Move m, const int depth, const uint64_t nodes, const clock_t duration);
\ No newline at end of file
+void infoString(const PV* pv, const int score, const int depth, const uint64_t nodes, const clock_t duration, const int multipv);
\ No newline at end of file
@@ -18,8 +18,13 @@ static char doc[] = "UCI compatible chess engine. Implements both Gaviota tableb
 
 static struct argp_option options[] = {
   {"train", 't', "PATH", 0, "Path which specifies the values to use as part of the training (not in use)"},
-  {"nnue", 'n', "PATH", 0, "Path which locates the NNUE" },
+  {"nnue", 'n', "PATH", 0, "Path which locates the NNUE, the embedded one is used without it" },
+  {"nnue-cache", 'c', "PATH", 0, "Compiled copy of the NNUE which is mapped instead of parsing it, created when it is missing or outdated" },
+  {"nnue-endgame", 'z', "PATH", 0, "NNUE which evaluates the positions with few pieces, see the EndgamePieces option" },
+  {"nnue-shared", 's', 0, 0, "Use a single copy of the NNUE in shared memory for every process, created by the first one" },
   {"gaviota", 'g', "PATH", 0, "Path which locates the Gaviota tablebases" },
+  {"evaluate", 'e', "PATH", 0, "Evaluates every position of the EPD file and exits, the score is appended to each one as the ce opcode" },
+  {"threads", 'j', "N", 0, "Threads used by --evaluate, one per core by default" },
   { 0 }
 };
 
@@ -40,6 +45,21 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
     case 'n':
       	arguments->nnue = arg;
       	break;
+    case 'c':
+      	arguments->nnueCache = arg;
+      	break;
+    case 's':
+      	arguments->nnueShared = 1;
+      	break;
+    case 'z':
+      	arguments->nnueEndgame = arg;
+      	break;
+    case 'e':
+      	arguments->evaluate = arg;
+      	break;
+    case 'j':
+      	arguments->threads = atoi(arg);
+      	break;
     case 'g':
     	arguments->gaviota = arg;
 
@@ -72,7 +92,12 @@ Arguments parseArguments(int argc, char** argv)
 	Arguments arguments;
 	arguments.train = NULL;
 	arguments.nnue = NULL;
+	arguments.nnueCache = NULL;
+	arguments.nnueShared = 0;
+	arguments.nnueEndgame = NULL;
 	arguments.gaviota = NULL;
+	arguments.evaluate = NULL;
+	arguments.threads = 0;
     argp_parse (&argp, argc, argv, 0, 0, &arguments);
 
     return arguments;
@@ -0,0 +1,264 @@
+/* batch.c
+ * Evaluates every position of an EPD file, each batch of positions is split between threads
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../include/global.h"
+#include "../include/board.h"
+#include "../include/moves.h"
+#include "../include/hash.h"
+#include "../include/sort.h"
+#include "../include/evaluation.h"
+#include "../include/nnue.h"
+#include "../include/search.h"
+#include "../include/batch.h"
+
+#define BATCH_SIZE 4096 //Positions read, evaluated and written at a time
+#define LINE_LEN 1024
+#define EPD_LEN (LINE_LEN + 32) //The counters of a FEN are written as opcodes
+
+/* The slice of the batch of a thread and its scratch, the stack is kept
+ * between batches so that its refresh entries are reused
+ */
+typedef struct
+{
+    NNUEStack st;
+    const Board* boards;
+    int* evals;
+    int n;
+} Worker;
+
+static void* evaluateSlice(void* _args)
+{
+    Worker* w = _args;
+
+    #ifdef USE_NNUE
+    evaluateBatch(&w->st, w->boards, w->n, w->evals);
+    #else
+    for (int i = 0; i < w->n; ++i)
+        w->evals[i] = eval(&w->boards[i]);
+    #endif
+
+    return NULL;
+}
+
+//Reads a line without the newline, the rest of a line that is too long is discarded
+static int readLine(FILE* f, char* line)
+{
+    if (!fgets(line, LINE_LEN, f))
+        return 0;
+
+    const size_t len = strcspn(line, "\r\n");
+    if (line[len] == '\0' && !feof(f))
+    {
+        int c;
+        while ((c = fgetc(f)) != '\n' && c != EOF);
+    }
+    line[len] = '\0';
+
+    return 1;
+}
+
+//Skips the spaces before the next field of s and returns its length, 0 at the end of the line
+static int nextField(const char** s)
+{
+    while (**s == ' ' || **s == '\t')
+        (*s)++;
+
+    return (int)strcspn(*s, " \t");
+}
+
+//8 ranks of 8 squares, one king per side and no pawns on the first and last ranks
+static int validPlacement(const char* s, const int len)
+{
+    int rank = 0, files = 0, kings[2] = {0, 0};
+    for (int i = 0; i < len; ++i)
+    {
+        if (s[i] == '/')
+        {
+            if (files != 8)
+                return 0;
+            rank++;
+            files = 0;
+        }
+        else if (s[i] >= '1' && s[i] <= '8')
+            files += s[i] - '0';
+        else if (strchr("pnbrqkPNBRQK", s[i]))
+        {
+            if ((s[i] == 'p' || s[i] == 'P') && (rank == 0 || rank == 7))
+                return 0;
+            kings[0] += s[i] == 'K';
+            kings[1] += s[i] == 'k';
+            files++;
+        }
+        else
+            return 0;
+
+        if (files > 8)
+            return 0;
+    }
+
+    return rank == 7 && files == 8 && kings[0] == 1 && kings[1] == 1;
+}
+
+static int validCastling(const char* s, const int len)
+{
+    if (len == 1 && s[0] == '-')
+        return 1;
+
+    return len <= 4 && (int)strspn(s, "KQkq") == len;
+}
+
+/* Checks the four fields of a FEN / EPD line, fen is the position for genFromFen and epd the line to write.
+ * The halfmove and fullmove counters of a FEN become the hmvc and fmvn opcodes, the other operations are kept
+ */
+static int parseLine(const char* line, char* fen, char* epd)
+{
+    const char* s = line;
+    const char* f[4];
+    int len[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        len[i] = nextField(&s);
+        f[i] = s;
+        s += len[i];
+        if (len[i] == 0)
+            return 0;
+    }
+
+    const int validEnPass = (len[3] == 1 && f[3][0] == '-')
+        || (len[3] == 2 && f[3][0] >= 'a' && f[3][0] <= 'h' && (f[3][1] == '3' || f[3][1] == '6'));
+    if (!validPlacement(f[0], len[0])
+        || len[1] != 1 || (f[1][0] != 'w' && f[1][0] != 'b')
+        || !validCastling(f[2], len[2])
+        || !validEnPass)
+        return 0;
+
+    int counters[2] = {0, 1};
+    int found = 0;
+    while (found < 2)
+    {
+        const char* c = s;
+        const int l = nextField(&c);
+        if (l == 0 || l > 6 || (int)strspn(c, "0123456789") != l)
+            break;
+        counters[found++] = atoi(c);
+        s = c + l;
+    }
+    nextField(&s);
+
+    sprintf(fen, "%.*s %.*s %.*s %.*s %d %d", len[0], f[0], len[1], f[1], len[2], f[2], len[3], f[3],
+        counters[0], counters[1]);
+
+    int w = sprintf(epd, "%.*s %.*s %.*s %.*s", len[0], f[0], len[1], f[1], len[2], f[2], len[3], f[3]);
+    if (found > 0)
+        w += sprintf(epd + w, " hmvc %d;", counters[0]);
+    if (found > 1)
+        w += sprintf(epd + w, " fmvn %d;", counters[1]);
+    if (*s)
+        sprintf(epd + w, " %s", s);
+
+    return 1;
+}
+
+/* Writes every position of path followed by its evaluation as the ce opcode, it is the score
+ * of the eval command. The positions are split in consecutive slices, so that the ones of the same
+ * game stay in the same thread, and the results are written in the order of the file after each batch
+ * threads <= 0 uses one per core. Lines that aren't a valid position are reported and skipped.
+ * Returns 0 if the file can't be read
+ */
+int evaluateEPD(const char* path, int threads)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Can't open EPD file: %s\n", path);
+        return 0;
+    }
+
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = min(max(threads, 1), MAX_THREADS);
+
+    Worker* workers = malloc(threads * sizeof(Worker));
+    char (*lines)[EPD_LEN] = malloc(BATCH_SIZE * sizeof(*lines));
+    Board* boards = malloc(BATCH_SIZE * sizeof(Board));
+    int* evals = malloc(BATCH_SIZE * sizeof(int));
+    CHECK_MALLOC(workers);
+    CHECK_MALLOC(lines);
+    CHECK_MALLOC(boards);
+    CHECK_MALLOC(evals);
+
+    for (int t = 0; t < threads; ++t)
+        attachNNUE(&workers[t].st);
+
+    const clock_t start = getTime();
+    uint64_t total = 0;
+    int n, ignore, lineNum = 0;
+    char line[LINE_LEN], fen[EPD_LEN];
+
+    do
+    {
+        n = 0;
+        while (n < BATCH_SIZE && readLine(f, line))
+        {
+            lineNum++;
+            //Blank lines and comments aren't positions
+            if (line[0] == '\0' || line[0] == '#')
+                continue;
+            if (!parseLine(line, fen, lines[n]))
+            {
+                fprintf(stderr, "Invalid position in line %d: %s\n", lineNum, line);
+                continue;
+            }
+            boards[n] = genFromFen(fen, &ignore);
+            n++;
+        }
+
+        pthread_t ids[MAX_THREADS];
+        int started[MAX_THREADS];
+        const int slice = (n + threads - 1) / threads;
+        for (int t = 0; t < threads; ++t)
+        {
+            Worker* w = &workers[t];
+            const int first = min(t * slice, n);
+            w->boards = boards + first;
+            w->evals = evals + first;
+            w->n = min(first + slice, n) - first;
+            //A slice whose thread can't be created is evaluated by this one
+            started[t] = t && pthread_create(&ids[t], NULL, evaluateSlice, w) == 0;
+        }
+        for (int t = 0; t < threads; ++t)
+            if (!started[t])
+                evaluateSlice(&workers[t]);
+        for (int t = 1; t < threads; ++t)
+            if (started[t])
+                pthread_join(ids[t], NULL);
+
+        for (int i = 0; i < n; ++i)
+            printf("%s ce %d;\n", lines[i], evals[i]);
+        fflush(stdout);
+
+        total += n;
+    } while (n == BATCH_SIZE);
+
+    const double elapsed = (double)(getTime() - start) / CLOCKS_PER_SEC;
+    fprintf(stderr, "%llu positions evaluated in %.2fs with %d threads (%.0f positions/s)\n",
+        (unsigned long long)total, elapsed, threads, elapsed > 0? total / elapsed : 0);
+
+    for (int t = 0; t < threads; ++t)
+        detachNNUE(&workers[t].st);
+
+    free(workers);
+    free(lines);
+    free(boards);
+    free(evals);
+    fclose(f);
+
+    return 1;
+}
@@ -16,6 +16,9 @@
 #include <assert.h>
 #include "../include/global.h"
 #include "../include/board.h"
+#include "../include/moves.h"
+#include "../include/hash.h"
+#include "../include/evaluation.h"
 
 #define INITIAL_WPIECES 0xffff
 #define INITIAL_WPAWN 0xff00
@@ -144,6 +147,9 @@ Board genFromFen(char* const fen, int* counter)
     if (b.castleInfo > 0xf)
         b.castleInfo &= 0xf;
 
+    b.pawnKey = hashPawns(&b);
+    computePsqt(&b, &b.psqt, &b.phase);
+
     *counter = i;
     return b;
 }
@@ -174,6 +180,8 @@ const Board defaultBoard()
     b.castleInfo = 0xf;
     b.allPieces = INITIAL_WPIECES | INITIAL_BPIECES;
     b.stm = WHITE;
+    b.pawnKey = hashPawns(&b);
+    computePsqt(&b, &b.psqt, &b.phase);
 
     return b;
 }
@@ -193,7 +201,8 @@ int equal(const Board* a, const Board* b)
         }
     }
 
-    int other = a->stm == b->stm && a->enPass == b->enPass;
+    int other = a->stm == b->stm && a->enPass == b->enPass && a->pawnKey == b->pawnKey
+        && a->psqt == b->psqt && a->phase == b->phase;
 
     return data && pieces && other;
 }
@@ -248,6 +257,11 @@ int boardIsOK(const Board* b)
         }
         ok &= ~b->color[c] == b->color[2|c];
     }
+    ok &= b->pawnKey == hashPawns(b);
+
+    int psqt, phase;
+    computePsqt(b, &psqt, &phase);
+    ok &= b->psqt == psqt && b->phase == phase;
 
     return ok;
 }
\ No newline at end of file
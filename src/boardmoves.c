@@ -9,6 +9,8 @@
 #include "../include/moves.h"
 #include "../include/magic.h"
 #include "../include/boardmoves.h"
+#include "../include/hash.h"
+#include "../include/evaluation.h"
 
 #include <assert.h>
 
@@ -42,11 +44,21 @@ inline static int rookMoved(const int color, const int from)
     return 0b1111;
 }
 
+/* Places or removes the piece, the scores of the board are updated accordingly
+ */
 inline static void flipBits(Board* b, const uint64_t from, const int piece, const int color)
 {
+    const int sqr = LSB_INDEX(from);
     b->piece[color][piece]  ^= from;
     b->color[color]         ^= from;
     b->color[color | 2]     ^= from;
+
+    const int sign = (b->piece[color][piece] & from)? 1 : -1;
+    b->psqt  += sign * PIECE_SQUARE[color][piece][sqr];
+    b->phase += sign * PHASE_WEIGHT[piece];
+
+    if (piece == PAWN)
+        b->pawnKey ^= pawnZobrist(color, sqr);
 }
 
 /* Flips the necessary bits for castling
@@ -62,23 +62,47 @@ typedef struct
     int result[2];
 } Eval;
 
+#define PAWN_ENTRIES 16384 //Per thread, 512KB
+
+/* Terms of the evaluation that only depend on the pawns, cached by the pawn key. They are counts
+ * (white - black) instead of scores, so the entries stay valid when the tuner changes the values
+ * passed -> Advanced pawns that count as passed, the advance bonus depends on the pieces
+ * passedOp / passedEg -> Bonus of the passed pawns for their rank and protection
+ * chain / doubled / isolated -> Number of pawns in each structure
+ * A position without pawns has the key 0 and all terms 0, so the empty entries are valid
+ */
+typedef struct
+{
+    uint64_t key;
+    uint64_t passed[2];
+    int16_t passedOp;
+    int16_t passedEg;
+    int8_t chain;
+    int8_t doubled;
+    int8_t isolated;
+} PawnEntry;
+
+static __thread PawnEntry pawnTable[PAWN_ENTRIES];
 
-static int phase(const Eval* ev);
+
+static int phase(const Board* b);
 
 // Main functions
-static void material(Eval* ev);
 static void pieceActivity(const Board* b, Eval* ev);
-static void passedPawns(uint64_t wp, uint64_t bp, Eval* ev);
-static void pawns(const Board* b, Eval* ev);
+static const PawnEntry* probePawns(const Board* b, const Eval* ev);
+static void passedPawns(const PawnEntry* pe, Eval* ev);
+static void pawns(const Board* b, const PawnEntry* pe, Eval* ev);
 static void kingSafety(const Board* b, Eval* ev);
 
-static void pst2(Eval* ev, const Board* b, const int color);
+static void pieceMoves(Eval* ev, const Board* b, const int color);
 static void rookOnOpenFile(const Board* b, Eval* ev);
 static void minorPieces(Eval* ev);
 static void space(const Board* b, Eval* ev, const int c);
 
 static int kingAtts(Eval* ev, const Board* b);
 
+static const int PST[2][6][64];
+
 
 //Shamelessly copied from chessprogramming (sf). 64 elements
 static const int kingAtt[70] = {
@@ -142,20 +166,51 @@ void initializeEvMov(Eval* ev, const Board* b)
     ev->result[OP] = 0; ev->result[EG] = 0;
 }
 
+int PIECE_SQUARE[2][6][64];
+const int PHASE_WEIGHT[6] = {0, 4, 2, 1, 1, 0};
+
+/* Has to be called again when the values change, the boards created before keep the old scores
+ */
 void initEval(void)
 {
+    const int* value[6] = {NULL, V_QUEEN, V_ROOK, V_BISH, V_KNIGHT, V_PAWN};
+    for (int c = BLACK; c <= WHITE; ++c)
+    {
+        const int sign = c? 1 : -1;
+        for (int p = KING; p <= PAWN; ++p)
+        {
+            for (int sqr = 0; sqr < 64; ++sqr)
+            {
+                const int index = c? sqr : 63 ^ sqr;
+                const int op = PST[OP][p][index] + (value[p]? value[p][OP] : 0);
+                const int eg = PST[EG][p][index] + (value[p]? value[p][EG] : 0);
+                PIECE_SQUARE[c][p][sqr] = MAKE_SCORE(sign * op, sign * eg);
+            }
+        }
+    }
 }
 
-int fastEval(const Board* b)
+/* Computes the scores that the board keeps updated from scratch
+ */
+void computePsqt(const Board* b, int* psqt, int* phase)
 {
-    Eval ev;
-    initializeEvMov(&ev, b);
-    ev.ph = phase(&ev);
-    material(&ev);
-    pst2(&ev, b, WHITE);
-    pst2(&ev, b, BLACK);
+    *psqt = 0;
+    *phase = 0;
+    for (int c = BLACK; c <= WHITE; ++c)
+    {
+        for (int p = KING; p <= PAWN; ++p)
+        {
+            for (uint64_t bb = b->piece[c][p]; bb; REMOVE_LSB(bb))
+                *psqt += PIECE_SQUARE[c][p][LSB_INDEX(bb)];
+            *phase += PHASE_WEIGHT[p] * POPCOUNT(b->piece[c][p]);
+        }
+    }
+}
 
-    const int evaluation = taperedEval(ev.ph, ev.result[0], ev.result[1]);
+//Material + PST, both are kept by the board
+int fastEval(const Board* b)
+{
+    const int evaluation = taperedEval(phase(b), scoreOP(b->psqt), scoreEG(b->psqt));
     return TEMPO + (b->stm? evaluation : -evaluation);
 }
 
@@ -169,12 +224,13 @@ int eval(const Board* b)
     Eval ev;
     initializeEvMov(&ev, b);
 
-    ev.ph = phase(&ev);
+    ev.ph = phase(b);
 
-    material(&ev);
+    ev.result[OP] += scoreOP(b->psqt);
+    ev.result[EG] += scoreEG(b->psqt);
 
-    pst2(&ev, b, WHITE);
-    pst2(&ev, b, BLACK);
+    pieceMoves(&ev, b, WHITE);
+    pieceMoves(&ev, b, BLACK);
 
     int ka = kingAtts(&ev, b);
     ev.result[OP] += ka; ev.result[EG] += ka / 2;
@@ -183,9 +239,11 @@ int eval(const Board* b)
 
     kingSafety(b, &ev);
 
-    passedPawns(b->piece[WHITE][PAWN], b->piece[BLACK][PAWN], &ev);
+    const PawnEntry* pe = probePawns(b, &ev);
+
+    passedPawns(pe, &ev);
 
-    pawns(b, &ev);
+    pawns(b, pe, &ev);
 
     space(b, &ev, WHITE);
     space(b, &ev, BLACK);
@@ -252,35 +310,14 @@ static int kingAtts(Eval* ev, const Board* b)
     return ((ev->attOnK[WHITE]>2)*kingAtt[min(ev->acc[WHITE], 69)] - (ev->attOnK[BLACK]>2)*kingAtt[min(ev->acc[BLACK], 69)]);
 }
 
-static int phase(const Eval* ev)
+static int phase(const Board* b)
 {
-    const int knPh = 1;
-    const int biPh = 1;
-    const int roPh = 2;
-    const int quPh = 4;
-
     const int totPh = 24;//((knPh + biPh + roPh) * 4) + (quPh * 2);
-
-    const int currPh =
-         totPh
-        -knPh * (ev->cnt[WHITE][KNIGHT] + ev->cnt[BLACK][KNIGHT])
-        -biPh * (ev->cnt[WHITE][BISH] + ev->cnt[BLACK][BISH])
-        -roPh * (ev->cnt[WHITE][ROOK] + ev->cnt[BLACK][ROOK])
-        -quPh * (ev->cnt[WHITE][QUEEN] + ev->cnt[BLACK][QUEEN]);
+    const int currPh = totPh - b->phase;
 
     return max(0, ((currPh * 256) + (totPh / 2)) / totPh);
 }
 
-
-static inline void material(Eval* ev)
-{
-    addVal(ev, V_QUEEN, ev->cnt[WHITE][QUEEN] - ev->cnt[BLACK][QUEEN]);
-    addVal(ev, V_ROOK, ev->cnt[WHITE][ROOK] - ev->cnt[BLACK][ROOK]);
-    addVal(ev, V_BISH, ev->cnt[WHITE][BISH] - ev->cnt[BLACK][BISH]);
-    addVal(ev, V_KNIGHT, ev->cnt[WHITE][KNIGHT] - ev->cnt[BLACK][KNIGHT]);
-    addVal(ev, V_PAWN, ev->cnt[WHITE][PAWN] - ev->cnt[BLACK][PAWN]);
-}
-
 static void mobility(const Board* b, Eval* ev)
 {
     //position fen 8/5P2/1PbNppp1/1P2b3/PP1P4/2B3p1/3Pn1P1/K1k5 w
@@ -334,26 +371,35 @@ static inline void kingSafety(const Board* b, Eval* ev)
     */
 }
 
-static void passedPawns(uint64_t wp, uint64_t bp, Eval* ev)
+/* Only recomputed when the pawn structure changes
+ */
+static const PawnEntry* probePawns(const Board* b, const Eval* ev)
 {
+    PawnEntry* pe = &pawnTable[b->pawnKey & (PAWN_ENTRIES - 1)];
+    if (pe->key == b->pawnKey)
+        return pe;
+
     const int open[8] = {0, 0,  0, 10, 15, 20, 40, 0};
     const int endg[8] = {0, 7, 15, 20, 30, 42, 70, 0};
-    int lsb = 0, op = 0, end = 0;
-    wp &= 0xffffffff00000000;
-    bp &= 0xffffffff;
-    uint64_t pos;
-    int isProtected, rank, advanceBonus;
+    const uint64_t wPawnBB = b->piece[WHITE][PAWN];
+    const uint64_t bPawnBB = b->piece[BLACK][PAWN];
+    uint64_t wp = wPawnBB & 0xffffffff00000000;
+    uint64_t bp = bPawnBB & 0xffffffff;
+    int lsb = 0, op = 0, end = 0, isProtected, rank, isol = 0;
+
+    pe->key = b->pawnKey;
+    pe->passed[WHITE] = 0;
+    pe->passed[BLACK] = 0;
     while(wp)
     {
         lsb = LSB_INDEX(wp);
         if ((getWPassedPawn(lsb) & bp) == 0)
         {
-            pos = 1ULL << lsb;
             rank = lsb >> 3;
-            isProtected = (ev->pawnAtts[WHITE] & pos)? rank : 0;
-            advanceBonus = ((pos << 8) & (ev->mostPieces | ev->all[BLACK]))? 0 : 12;
+            isProtected = (ev->pawnAtts[WHITE] & POW2[lsb])? rank : 0;
             op  += open[rank] + isProtected;
-            end += endg[rank] + 2*isProtected + advanceBonus;
+            end += endg[rank] + 2*isProtected;
+            pe->passed[WHITE] |= POW2[lsb];
         }
         REMOVE_LSB(wp);
     }
@@ -362,28 +408,46 @@ static void passedPawns(uint64_t wp, uint64_t bp, Eval* ev)
         lsb = LSB_INDEX(bp);
         if ((getBPassedPawn(lsb) & wp) == 0)
         {
-            pos = 1ULL << lsb;
             rank = 7 ^ (lsb >> 3);
-            isProtected = (ev->pawnAtts[BLACK] & pos)? rank : 0;
-            advanceBonus = ((pos >> 8) & (ev->mostPieces | ev->all[WHITE]))? 0 : 12;
+            isProtected = (ev->pawnAtts[BLACK] & POW2[lsb])? rank : 0;
             op  -= open[rank] + isProtected;
-            end -= endg[rank] + 2*isProtected + advanceBonus;
+            end -= endg[rank] + 2*isProtected;
+            pe->passed[BLACK] |= POW2[lsb];
         }
         REMOVE_LSB(bp);
     }
+    pe->passedOp = op;
+    pe->passedEg = end;
+
+    for (uint64_t temp = wPawnBB; temp; REMOVE_LSB(temp))
+        isol += !(getPawnLanes(LSB_INDEX(temp) & 7) & wPawnBB);
+    for (uint64_t temp = bPawnBB; temp; REMOVE_LSB(temp))
+        isol -= !(getPawnLanes(LSB_INDEX(temp) & 7) & bPawnBB);
+    pe->isolated = isol;
+
+    pe->chain = POPCOUNT(wPawnBB & ev->pawnAtts[WHITE]) - POPCOUNT(bPawnBB & ev->pawnAtts[BLACK]);
+    pe->doubled = POPCOUNT(wPawnBB & ((wPawnBB << 8) | (wPawnBB << 16))) - POPCOUNT(bPawnBB & ((bPawnBB >> 8) | (bPawnBB >> 16)));
 
-    ev->result[OP] += op;
-    ev->result[EG] += end;
+    return pe;
 }
 
-static void pawns(const Board* b, Eval* ev)
+//A passed pawn whose square in front is free gets the advance bonus
+static void passedPawns(const PawnEntry* pe, Eval* ev)
 {
-    const uint64_t wPawnBB = b->piece[WHITE][PAWN];
-    const uint64_t bPawnBB = b->piece[BLACK][PAWN];
-    addVal(ev, PAWN_CHAIN, POPCOUNT(wPawnBB & ev->pawnAtts[WHITE]) - POPCOUNT(bPawnBB & ev->pawnAtts[BLACK]));
+    const int wFree = POPCOUNT((pe->passed[WHITE] << 8) & ~(ev->mostPieces | ev->all[BLACK]));
+    const int bFree = POPCOUNT((pe->passed[BLACK] >> 8) & ~(ev->mostPieces | ev->all[WHITE]));
+
+    ev->result[OP] += pe->passedOp;
+    ev->result[EG] += pe->passedEg + 12 * (wFree - bFree);
+}
+
+static void pawns(const Board* b, const PawnEntry* pe, Eval* ev)
+{
+    addVal(ev, PAWN_CHAIN, pe->chain);
+    addVal(ev, N_DOUBLED_PAWNS, pe->doubled);
+    addVal(ev, N_ISOLATED_PAWN, pe->isolated);
     addVal(ev, PAWN_PROTECTION_BISH, POPCOUNT(ev->pawnAtts[WHITE] & b->piece[WHITE][BISH] & ~ev->pawnAtts[BLACK]) - POPCOUNT(ev->pawnAtts[BLACK] & b->piece[BLACK][BISH] & ~ev->pawnAtts[WHITE]));
     addVal(ev, PAWN_PROTECTION_KNIG, POPCOUNT(ev->pawnAtts[WHITE] & b->piece[WHITE][KNIGHT] & ~ev->pawnAtts[BLACK]) - POPCOUNT(ev->pawnAtts[BLACK] & b->piece[BLACK][KNIGHT] & ~ev->pawnAtts[WHITE]));
-    addVal(ev, N_DOUBLED_PAWNS, POPCOUNT(wPawnBB & ((wPawnBB << 8) | (wPawnBB << 16))) - POPCOUNT(bPawnBB & ((bPawnBB >> 8) | (bPawnBB >> 16))));
     //addVal(ATTACKED_BY_PAWN_LATER, POPCOUNT((wPawnBBAtt << 8) & b->color[BLACK]) - POPCOUNT((bPawnBBAtt >> 8) & b->color[WHITE]));
 
     const int wMinor = POPCOUNT(ev->pawnAtts[WHITE] & (b->piece[BLACK][KNIGHT] | b->piece[BLACK][BISH]));
@@ -454,7 +518,7 @@ static const int PST[2][6][64] = {
 }};
 
 
-static void psHelper(Eval* ev, const Board* b, const int piece, const int c, int* opening, int* endgame, int* isol, uint64_t (*move) (int, uint64_t))
+static void psHelper(Eval* ev, const Board* b, const int piece, const int c, uint64_t (*move) (int, uint64_t))
 {
     uint64_t bb = b->piece[c][piece], mv;
 
@@ -462,59 +526,34 @@ static void psHelper(Eval* ev, const Board* b, const int piece, const int c, int
     while(bb)
     {
         const int lsb = LSB_INDEX(bb);
-        const int index = c? lsb : 63 ^ lsb;
-
-        *opening += PST[OP][piece][index];
-        *endgame += PST[EG][piece][index];
 
-        if (piece != PAWN && piece != KING)
-        {
-            //The king is fairly important as a blocker
-            mv = move(lsb, ev->mostPieces);
+        //The king is fairly important as a blocker
+        mv = move(lsb, ev->mostPieces);
 
-            ev->movs[c][piece] |= mv;
-            ev->all2[c] |= mv & ev->all[c];
-            ev->all[c] |= mv;
+        ev->movs[c][piece] |= mv;
+        ev->all2[c] |= mv & ev->all[c];
+        ev->all[c] |= mv;
 
-            if (mv & ev->kingDanger[1^c])
-            {
-                ev->attOnK[c]++;
-                ev->acc[c] += POPCOUNT(mv & ev->kingDanger[1^c]) * attWg[piece];
-            }
-            if (0 && mv & ev->kingDanger[c])
-            {
-                ev->acc[1^c] -= defWg[piece];
-            }
+        if (mv & ev->kingDanger[1^c])
+        {
+            ev->attOnK[c]++;
+            ev->acc[c] += POPCOUNT(mv & ev->kingDanger[1^c]) * attWg[piece];
         }
-        else if (piece == PAWN)
+        if (0 && mv & ev->kingDanger[c])
         {
-            if (!(getPawnLanes(lsb & 7) & b->piece[c][PAWN]))
-                (*isol)++;
+            ev->acc[1^c] -= defWg[piece];
         }
 
         REMOVE_LSB(bb);
     }
 }
 
-static void pst2(Eval* ev, const Board* b, const int color)
+/* Moves of the pieces, the material and the PST are kept by the board
+ */
+static void pieceMoves(Eval* ev, const Board* b, const int color)
 {
-    int opening = 0, endgame = 0, isol = 0;
-
-    psHelper(ev, b, KING,   color, &opening, &endgame, &isol, auxKnightMoves);
-    psHelper(ev, b, QUEEN,  color, &opening, &endgame, &isol, getQueenMagicMoves);
-    psHelper(ev, b, ROOK,   color, &opening, &endgame, &isol, getRookMagicMoves);
-    psHelper(ev, b, BISH,   color, &opening, &endgame, &isol, getBishMagicMoves);
-    psHelper(ev, b, KNIGHT, color, &opening, &endgame, &isol, auxKnightMoves);
-    psHelper(ev, b, PAWN,   color, &opening, &endgame, &isol, auxKnightMoves);
-
-    if (color)
-    {
-        ev->result[OP] += opening; ev->result[EG] += endgame;
-        addVal(ev, N_ISOLATED_PAWN, isol);
-    }
-    else
-    {
-        ev->result[OP] -= opening; ev->result[EG] -= endgame;
-        addVal(ev, N_ISOLATED_PAWN, -isol);
-    }
-}
\ No newline at end of file
+    psHelper(ev, b, QUEEN,  color, getQueenMagicMoves);
+    psHelper(ev, b, ROOK,   color, getRookMagicMoves);
+    psHelper(ev, b, BISH,   color, getBishMagicMoves);
+    psHelper(ev, b, KNIGHT, color, auxKnightMoves);
+}
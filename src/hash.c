@@ -11,8 +11,37 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 
-Eval* table = NULL;
+#define HUGE_PAGE 0x200000 //2MB
+
+Cluster* table = NULL;
+static uint64_t numClusters = 0;
+
+/* Static evaluations, direct mapped. Each entry is the hash with the eval in the low 16 bits,
+ * the index covers at least those 16 bits, so the whole hash is checked with a single word
+ */
+static _Atomic uint64_t* evalCache = NULL;
+static uint64_t evalCacheMask = 0;
+
+/* Incremented at every search, so that entries from older searches are replaced first */
+static uint64_t generation = 0;
+
+#define GEN_MASK 0x3f
+#define TT_MATE 31000 //Mate scores are stored as TT_MATE +- the distance to PLUS_MATE
+#define TT_MATE_BOUND 30000
+
+#define PACK_DATA(m, val, eval, depth, flag) ((uint64_t)(m) | ((uint64_t)(uint16_t)(val) << 16) \
+    | ((uint64_t)(uint16_t)(eval) << 32) | ((uint64_t)(depth) << 48) | ((uint64_t)(flag) << 56) | (generation << 58))
+#define DATA_MOVE(d)  ((int)((d) & 0xffff))
+#define DATA_VAL(d)   ((int)(int16_t)((d) >> 16))
+#define DATA_EVAL(d)  ((int)(int16_t)((d) >> 32))
+#define DATA_DEPTH(d) ((int)(((d) >> 48) & 0xff))
+#define DATA_FLAG(d)  ((int)(((d) >> 56) & 3))
+#define DATA_GEN(d)   ((d) >> 58)
 
 const uint64_t zobRandom[781] =
 {0xa4eb873de16a53d0, 0xadaba31f919ffb63, 0x3463394ba75e4d58, 0xc2856572e6e47f50,
@@ -216,20 +245,231 @@ const uint64_t zobRandom[781] =
  */
 void initializeTable(void)
 {
+    resizeEvalCache(DEFAULT_EVAL_CACHE);
+    resizeTable(DEFAULT_HASH, 1);
+}
+
+/* The table is aligned to 2MB and backed by transparent huge pages when available,
+ * a single TLB entry then covers 32768 clusters instead of 64
+ */
+void resizeTable(const int mb, const int numThreads)
+{
+    const size_t bytes = ((size_t)min(max(mb, 1), MAX_HASH) << 20) & ~(size_t)(HUGE_PAGE - 1);
+    const size_t size = (bytes > HUGE_PAGE)? bytes : HUGE_PAGE;
+
     free(table);
-    table = calloc(NUM_ENTRIES, sizeof(Eval));
+    table = NULL;
+    if (posix_memalign((void**)&table, HUGE_PAGE, size))
+        table = NULL;
     CHECK_MALLOC(table);
-    /*
-    Eval* end;
-    end = table + NUM_ENTRIES;
-    for (Eval* ptr = table; ptr < end; ++ptr)
-        ptr->key = 0;
-    */
+    #ifdef MADV_HUGEPAGE
+    madvise(table, size, MADV_HUGEPAGE);
+    #endif
+
+    numClusters = size / sizeof(Cluster);
+    reinitializeTable(numThreads);
+}
+
+typedef struct
+{
+    Cluster* start;
+    size_t len;
+} ClearArgs;
+
+static void* clearRange(void* _args)
+{
+    const ClearArgs* args = _args;
+    memset(args->start, 0, args->len * sizeof(Cluster));
+    return NULL;
+}
+
+/* Each thread clears its own slice, touching the pages from several cores at once
+ */
+void reinitializeTable(const int numThreads)
+{
+    const int n = max(numThreads, 1);
+    pthread_t ids[n];
+    ClearArgs args[n];
+    const size_t slice = numClusters / n;
+
+    for (int i = 0; i < n; ++i)
+    {
+        args[i].start = table + i * slice;
+        args[i].len = (i == n - 1)? numClusters - i * slice : slice;
+        if (i > 0)
+            pthread_create(&ids[i], NULL, clearRange, &args[i]);
+    }
+    clearRange(&args[0]);
+    for (int i = 1; i < n; ++i)
+        pthread_join(ids[i], NULL);
+
+    generation = 0;
+    clearEvalCache();
+}
+
+void newSearchTT(void)
+{
+    generation = (generation + 1) & GEN_MASK;
+}
+
+/* The number of entries is rounded down to a power of 2, the index is then hash & mask
+ */
+void resizeEvalCache(const int mb)
+{
+    uint64_t entries = ((uint64_t)min(max(mb, 1), MAX_EVAL_CACHE) << 20) / sizeof(uint64_t);
+    while (entries & (entries - 1))
+        entries &= entries - 1;
+
+    free(evalCache);
+    evalCache = NULL;
+    if (posix_memalign((void**)&evalCache, 64, entries * sizeof(uint64_t)))
+        evalCache = NULL;
+    CHECK_MALLOC(evalCache);
+
+    evalCacheMask = entries - 1;
+    clearEvalCache();
+}
+
+void clearEvalCache(void)
+{
+    if (evalCache)
+        memset(evalCache, 0, (evalCacheMask + 1) * sizeof(uint64_t));
+}
+
+/* Scores have to fit in 16 bits, mate scores are kept relative to PLUS_MATE
+ */
+static inline int scoreToTT(const int v)
+{
+    if (v >= PLUS_MATE - (TT_MATE - TT_MATE_BOUND))
+        return min(TT_MATE + (v - PLUS_MATE), SHRT_MAX);
+    if (v <= MINS_MATE + (TT_MATE - TT_MATE_BOUND))
+        return max(-TT_MATE + (v - MINS_MATE), -SHRT_MAX);
+    return min(max(v, -TT_MATE_BOUND + 1), TT_MATE_BOUND - 1);
+}
+static inline int scoreFromTT(const int v)
+{
+    if (v >= TT_MATE_BOUND)
+        return PLUS_MATE + (v - TT_MATE);
+    if (v <= -TT_MATE_BOUND)
+        return MINS_MATE + (v + TT_MATE);
+    return v;
+}
+
+/* Move in 16 bits, piece (3) | from (6) | to (6), 0 is no move
+ */
+static inline int packMove(const Move m)
+{
+    return (m.from == -1)? 0 : (m.piece << 12) | (m.from << 6) | m.to;
+}
+static inline Move unpackMove(const int packed)
+{
+    if (packed == 0)
+        return (Move) {.from = -1, .to = -1};
+    return (Move) {.piece = packed >> 12, .from = (packed >> 6) & 63, .to = packed & 63, .capture = NO_PIECE};
 }
 
-void reinitializeTable(void)
+/* Maps the hash to [0, numClusters) with a multiplication instead of a modulo, works for any size
+ */
+static inline uint64_t clusterIndex(const uint64_t hash)
 {
-    memset(table, 0, NUM_ENTRIES*sizeof(Eval));
+    return (uint64_t)(((unsigned __int128)hash * numClusters) >> 64);
+}
+
+/* Called as soon as the hash of a child is known, the cluster is in the cache once the child probes it
+ */
+void prefetchTT(const uint64_t hash)
+{
+    PREFETCH(&table[clusterIndex(hash)]);
+}
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_relaxed)
+#define STORE(x, v) atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+/* A writer may be storing the entry meanwhile, if the words come from different stores
+ * key ^ data won't be the hash and the entry is ignored
+ */
+int probeTT(const uint64_t hash, Eval* e)
+{
+    TTEntry* cluster = table[clusterIndex(hash)].entry;
+    for (int i = 0; i < CLUSTER_SIZE; ++i)
+    {
+        const uint64_t data = LOAD(cluster[i].data);
+        if ((LOAD(cluster[i].key) ^ data) == hash)
+        {
+            *e = (Eval) {.key = hash, .val = scoreFromTT(DATA_VAL(data)), .eval = scoreFromTT(DATA_EVAL(data)),
+                .depth = DATA_DEPTH(data), .flag = DATA_FLAG(data), .m = unpackMove(DATA_MOVE(data))};
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* A single word, so it can't be torn by a concurrent store
+ */
+int probeEvalCache(const uint64_t hash, int* eval)
+{
+    if (!evalCache)
+        return 0;
+
+    const uint64_t entry = LOAD(evalCache[hash & evalCacheMask]);
+    if ((entry ^ hash) & ~0xffffULL)
+        return 0;
+
+    *eval = (int16_t)entry;
+    return 1;
+}
+
+void storeEvalCache(const uint64_t hash, const int eval)
+{
+    if (evalCache && eval > SHRT_MIN && eval <= SHRT_MAX)
+        STORE(evalCache[hash & evalCacheMask], (hash & ~0xffffULL) | (uint16_t)eval);
+}
+
+/* The position goes to its own entry if it is already in the cluster (or to an empty one),
+ * otherwise it replaces the entry with the lowest depth, the ones from older searches count as shallower.
+ * A deeper result for the same position from this search is only replaced by an exact one or by a similar depth
+ */
+void storeTT(const uint64_t hash, const Move m, const int val, const int eval, const int depth, const int flag)
+{
+    TTEntry* cluster = table[clusterIndex(hash)].entry;
+    TTEntry* replace = cluster;
+    uint64_t replaceData = 0, data;
+    int worth, minWorth = INT_MAX, sameKey = 0;
+    int packed = packMove(m);
+
+    for (int i = 0; i < CLUSTER_SIZE; ++i)
+    {
+        TTEntry* e = &cluster[i];
+        data = LOAD(e->data);
+        const uint64_t key = LOAD(e->key) ^ data;
+        if (key == hash || key == 0)
+        {
+            replace = e;
+            replaceData = data;
+            sameKey = key == hash;
+            break;
+        }
+
+        worth = DATA_DEPTH(data) - 8 * (int)((generation - DATA_GEN(data)) & GEN_MASK);
+        if (worth < minWorth)
+        {
+            minWorth = worth;
+            replace = e;
+        }
+    }
+
+    if (sameKey)
+    {
+        if (flag != EXACT && depth + 2 < DATA_DEPTH(replaceData) && DATA_GEN(replaceData) == generation)
+            return;
+        if (!packed)
+            packed = DATA_MOVE(replaceData);
+    }
+
+    data = PACK_DATA(packed, scoreToTT(val), scoreToTT(eval), depth, flag);
+    STORE(replace->data, data);
+    STORE(replace->key, hash ^ data);
 }
 
 /* Detects if the last move makes a 3fold repetion
@@ -287,6 +527,24 @@ uint64_t hashPosition(const Board* b)
     return resultHash;
 }
 
+/* Hashes only the pawns, a position without pawns is 0
+ */
+uint64_t hashPawns(const Board* b)
+{
+    uint64_t pawnHash = 0;
+    for (int c = BLACK; c <= WHITE; ++c)
+    {
+        uint64_t temp = b->piece[c][PAWN];
+        while (temp)
+        {
+            pawnHash ^= pawnZobrist(c, LSB_INDEX(temp));
+            REMOVE_LSB(temp);
+        }
+    }
+
+    return pawnHash;
+}
+
 inline uint64_t changeTurn(const uint64_t prev)
 {
     return prev ^ zobRandom[TURN_OFFSET];
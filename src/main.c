@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <argp.h>
+#include <unistd.h>
 
 #include "../include/global.h"
 #include "../include/memoization.h"
@@ -14,15 +15,16 @@
 #include "../include/moves.h"
 #include "../include/boardmoves.h"
 #include "../include/hash.h"
-#include "../include/uci.h"
 #include "../include/io.h"
 #include "../include/magic.h"
 #include "../include/evaluation.h"
-#include "../include/search.h"
 #include "../include/sort.h"
-#include "../include/movegen.h"
 #include "../include/nnue.h"
+#include "../include/search.h"
+#include "../include/uci.h"
+#include "../include/movegen.h"
 #include "../include/argparser.h"
+#include "../include/batch.h"
 #ifdef USE_TB
 #include "../include/gaviota.h"
 #endif
@@ -33,6 +35,16 @@
 //TODO: In move, use uint64_t in .from and .to to make faster makeMove / undoMove and implement syzygy
 int main(const int argc, char** const argv)
 {
+    Arguments arguments = parseArguments(argc, argv);
+
+    //With --evaluate stdout is only the EPD, the banner and the loading messages go to stderr
+    int epdOut = -1;
+    if (arguments.evaluate != NULL)
+    {
+        epdOut = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
     #ifdef NDEBUG
     printf("    _   __      ______   _   ___   ____  ________\n   / | / /___  / ____/  / | / / | / / / / / ____/\n  /  |/ / __ \\/ /      /  |/ /  |/ / / / / __/   \n / /|  / /_/ / /___   / /|  / /|  / /_/ / /___   \n/_/ |_/\\____/\\____/  /_/ |_/_/ |_/\\____/_____/   \n\n");
     printf("%s (RELEASE) uci chess engine made by %s\n", ENGINE_NAME, ENGINE_AUTHOR);
@@ -42,11 +54,10 @@ int main(const int argc, char** const argv)
     #endif
     printf("Use --help for more information\n");
 
-    Arguments arguments = parseArguments(argc, argv);
-
     initMemo();
     initMagics();
     initializeTable();
+    initEval();
 
     #ifdef TRAIN
     if (arguments.train != NULL) {
@@ -60,16 +71,22 @@ int main(const int argc, char** const argv)
     }
     #endif
 
-    initEval();
     initSort();
 
     #ifdef USE_NNUE
+    //Only a network that fails at startup is fatal, loadnnue keeps the current one
     if (arguments.nnue != NULL) {
-        initNNUE(arguments.nnue);
+        if (!initNNUE(NNUE_MAIN, arguments.nnue, arguments.nnueCache, arguments.nnueShared))
+            exit(5);
+    } else if (hasEmbeddedNNUE()) {
+        if (!initNNUE(NNUE_MAIN, NULL, NULL, 0))
+            exit(5);
     } else {
         fprintf(stderr, "No --nnue argument was provided. Initializing without.\n");
         exit(101);
     }
+    if (arguments.nnueEndgame != NULL && !initNNUE(NNUE_ENDGAME, arguments.nnueEndgame, NULL, arguments.nnueShared))
+        exit(5);
     #endif
 
     #ifdef USE_TB
@@ -81,6 +98,14 @@ int main(const int argc, char** const argv)
     }
     #endif
 
+    if (arguments.evaluate != NULL)
+    {
+        fflush(stdout);
+        dup2(epdOut, STDOUT_FILENO);
+        close(epdOut);
+        exit(evaluateEPD(arguments.evaluate, arguments.threads)? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     //chooseTest(6);
 
     loop();
@@ -2,21 +2,30 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "../include/global.h"
 #include "../include/board.h"
 #include "../include/moves.h"
 #include "../include/boardmoves.h"
+#include "../include/allmoves.h"
 #include "../include/nnue.h"
 #include "../include/nnuearch.h"
+#include "../include/nnuesimd.h"
 
 #define CHECK_READ(read,correct) if (read != correct) {fprintf(stderr, "Unsuccessful read in %s %d\n", __FILE__, __LINE__); \
-                                exit(5);}
+                                return 0;}
 
-void readHeaders(FILE* f);
-void readParams(FILE* f, NNUE* nn);
-void readWeights(FILE* f, weight_t* nn, const int dims, const int isOutput);
+int readHeaders(FILE* f);
+int readParams(FILE* f, NNUE* nn);
+int readWeights(FILE* f, weight_t* nn, const int dims);
 void showNNUE(const NNUE* nn);
+static void resetRefresh(NNUEStack* st, const int net);
 
 const uint32_t FTHeader = 0x5d69d7b8;
 const uint32_t NTHeader = 0x63337156;
@@ -45,15 +54,412 @@ const uint32_t PieceToIndex[2][16] = {
 };
 
 
-static NNUE nnue;
-static int16_t nInput[kDimensionFT];
+/* A loaded network. The current one holds a reference and so does every search that started with it,
+ * a reload swaps current and the old network is freed by the last one to release it
+ */
+typedef struct
+{
+    NNUE nn;
+    atomic_int refs;
+} LoadedNNUE;
+
+static LoadedNNUE* current[NNUE_NETS] = {NULL};
+static pthread_mutex_t currentMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Positions with at most this many pieces, kings included, are evaluated by the endgame network
+static int endgamePieces = 8;
+
+//Incremented whenever the evaluation changes (a network is loaded or unloaded, the threshold changes)
+static atomic_uint generation = 0;
+
+/* The variant of the hidden layers in use and the one set with the NNUEKernel option,
+ * variant is read by the search threads while loadnnue may run
+ */
+static atomic_int variant = VARIANT_SPARSE;
+static int requestedVariant = VARIANT_AUTO;
+static int variantSet = 0;
+
+#define NNUE_ALIGN 64
+#define NNUE_CACHE_VERSION 2
+#define SHARED_WAIT 200 //Tries to attach to a shared copy that is being created, every 10ms
+
+/* Header of the network cache and of the shared copy, the arrays follow it with the layout of layoutNNUE
+ * A cache is only valid for the network file with the same size and modification time,
+ * the shared copy is found by the hash of the contents of the file
+ * magic is written last, a copy without it isn't complete
+ */
+typedef struct
+{
+    _Atomic uint64_t magic;
+    uint32_t version;
+    uint32_t network;
+    uint64_t size;
+    uint64_t sourceSize;
+    int64_t sourceMtime;
+    uint64_t hash;
+} NNUECacheHeader;
+
+static const uint64_t CacheMagic = 0x65756e6e434f4eULL; //"NoCnnue"
+
+//Makes loaded (NULL to unload) the current network of the set
+static void swapNNUE(const int net, LoadedNNUE* loaded)
+{
+    pthread_mutex_lock(&currentMutex);
+    LoadedNNUE* old = current[net];
+    current[net] = loaded;
+    atomic_fetch_add(&generation, 1);
+    pthread_mutex_unlock(&currentMutex);
+
+    if (old)
+        releaseNNUE(&old->nn);
+}
+
+/* Loads the network aside and makes it the current one of the set (NNUE_MAIN, NNUE_ENDGAME),
+ * it can be called during a search since the search keeps the networks it started with.
+ * The dimensions are fixed at compile time, so only the first network picks the variant
+ * Returns 0 if the network can't be loaded, the current one is kept
+ */
+int initNNUE(const int net, const char* path, const char* cachePath, const int shared)
+{
+    if (!current[NNUE_MAIN] && !current[NNUE_ENDGAME])
+        initSimd();
+
+    LoadedNNUE* loaded = malloc(sizeof(LoadedNNUE));
+    CHECK_MALLOC(loaded);
+    if (!loadNNUE(&loaded->nn, path, cachePath, shared))
+    {
+        free(loaded);
+        return 0;
+    }
+    atomic_init(&loaded->refs, 1);
+
+    swapNNUE(net, loaded);
+
+    if (net == NNUE_MAIN && !variantSet)
+        setNNUEVariant(requestedVariant);
+
+    return 1;
+}
+
+//Without the endgame network every position is evaluated by the main one
+void unloadNNUE(const int net)
+{
+    swapNNUE(net, NULL);
+}
+
+void setEndgamePieces(const int n)
+{
+    endgamePieces = n;
+    atomic_fetch_add(&generation, 1);
+}
+
+//Evaluations taken with a different generation may not match the current networks
+unsigned nnueGeneration(void)
+{
+    return atomic_load(&generation);
+}
+
+//Takes a reference to the current network, NULL if none has been loaded
+const NNUE* acquireNNUE(const int net)
+{
+    pthread_mutex_lock(&currentMutex);
+    LoadedNNUE* loaded = current[net];
+    if (loaded)
+        atomic_fetch_add(&loaded->refs, 1);
+    pthread_mutex_unlock(&currentMutex);
+
+    return loaded? &loaded->nn : NULL;
+}
+
+void releaseNNUE(const NNUE* nn)
+{
+    if (!nn)
+        return;
+
+    LoadedNNUE* loaded = (LoadedNNUE*)nn;
+    if (atomic_fetch_sub(&loaded->refs, 1) == 1)
+    {
+        freeNNUE(&loaded->nn);
+        free(loaded);
+    }
+}
+
+/* The stack of a search thread uses the current networks and threshold until it is detached,
+ * a reload in the meantime doesn't change them. The refresh entries are reset for them
+ */
+void attachNNUE(NNUEStack* st)
+{
+    for (int net = NNUE_MAIN; net < NNUE_NETS; ++net)
+    {
+        st->nn[net] = acquireNNUE(net);
+        if (st->nn[net])
+            resetRefresh(st, net);
+    }
+    st->endgamePieces = endgamePieces;
+}
+
+void detachNNUE(NNUEStack* st)
+{
+    for (int net = NNUE_MAIN; net < NNUE_NETS; ++net)
+    {
+        releaseNNUE(st->nn[net]);
+        st->nn[net] = NULL;
+    }
+}
+
+//The network of st that evaluates b
+static inline int netOf(const NNUEStack* st, const Board* b)
+{
+    return st->nn[NNUE_ENDGAME] && POPCOUNT(b->allPieces) <= st->endgamePieces? NNUE_ENDGAME : NNUE_MAIN;
+}
+
+static inline size_t alignUp(const size_t x)
+{
+    return (x + NNUE_ALIGN - 1) & ~(size_t)(NNUE_ALIGN - 1);
+}
+
+/* Points every array of nn into mem, after the room for the cache header
+ * Returns the size of the block, mem can be NULL to only compute it
+ */
+static size_t layoutNNUE(NNUE* nn, char* mem)
+{
+    size_t offset = alignUp(sizeof(NNUECacheHeader));
+
+    #define PLACE(field, n) \
+        nn->field = mem? (void*)(mem + offset) : NULL; \
+        offset = alignUp(offset + sizeof(*nn->field) * (n));
+
+    PLACE(ftBiases, kHalfDimensionFT);
+    PLACE(ftWeights, kHalfDimensionFT * kInputDimensionsFT);
+    PLACE(biases1, kDimensionHidden);
+    PLACE(weights1, kDimensionHidden * kDimensionFT);
+    PLACE(weights1Sparse, kDimensionHidden * kDimensionFT);
+    PLACE(biases2, kDimensionHidden);
+    PLACE(weights2, kDimensionHidden * kDimensionHidden);
+    PLACE(outputB, 1);
+    PLACE(outputW, kDimensionHidden);
+
+    #undef PLACE
+
+    return offset;
+}
+
+/* The block is mapped instead of malloc'd so that freeing it always returns the memory,
+ * with malloc the blocks of repeated reloads stay in the heap
+ */
+void allocNNUE(NNUE* nn)
+{
+    *nn = (NNUE) {};
+    nn->size = layoutNNUE(nn, NULL);
+    nn->mem = mmap(NULL, nn->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (nn->mem == MAP_FAILED)
+        nn->mem = NULL;
+    CHECK_MALLOC(nn->mem);
+    layoutNNUE(nn, nn->mem);
+}
+
+/* 64 bit hash of the contents of the network file, the name of the shared copy
+ */
+static uint64_t hashFile(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    uint64_t h = 0xcbf29ce484222325ULL, buf[4096];
+    size_t n, total = 0;
+
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    {
+        memset((char*)buf + n, 0, sizeof(buf) - n);
+        for (size_t i = 0; i < (n + 7) / 8; ++i)
+        {
+            h = (h ^ buf[i]) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 32;
+        }
+        total += n;
+    }
+    fclose(f);
+
+    return h ^ total;
+}
+
+//The block is a complete copy of this architecture
+static int validBlock(const void* mem, const size_t size)
+{
+    const NNUECacheHeader* h = (const NNUECacheHeader*)mem;
+    return atomic_load_explicit(&h->magic, memory_order_acquire) == CacheMagic
+        && h->version == NNUE_CACHE_VERSION
+        && h->network == NNUEHash
+        && h->size == size;
+}
+
+/* Maps the block in fd read only and closes fd, fails if the block isn't valid
+ * The pages are shared with every other process that maps it
+ */
+static int mapBlock(NNUE* nn, const int fd)
+{
+    *nn = (NNUE) {};
+    const size_t size = layoutNNUE(nn, NULL);
+
+    struct stat st;
+    void* mem = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+        mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mem == MAP_FAILED)
+        return 0;
+
+    if (!validBlock(mem, size))
+    {
+        munmap(mem, size);
+        return 0;
+    }
+
+    nn->mem = mem;
+    nn->size = size;
+    nn->storage = NNUE_MAPPED;
+    layoutNNUE(nn, mem);
+
+    return 1;
+}
+
+/* The block compiled into the binary with make EMBED=path, it lives in the read only data
+ * so it is used like a mapped cache. The symbols are weak, they are NULL without it
+ */
+extern const char embeddedNNUE[] __attribute__((weak));
+extern const char embeddedNNUEEnd[] __attribute__((weak));
 
-void initNNUE(const char* path)
+int hasEmbeddedNNUE(void)
 {
-    nnue = loadNNUE(path);
+    return embeddedNNUE != NULL;
+}
+
+static int loadEmbedded(NNUE* nn)
+{
+    *nn = (NNUE) {};
+    const size_t size = layoutNNUE(nn, NULL);
+
+    if (!hasEmbeddedNNUE() || (size_t)(embeddedNNUEEnd - embeddedNNUE) != size || !validBlock(embeddedNNUE, size))
+    {
+        fprintf(stderr, "The embedded NNUE isn't valid for this architecture\n");
+        return 0;
+    }
+
+    nn->mem = (void*)embeddedNNUE;
+    nn->size = size;
+    nn->storage = NNUE_EMBEDDED;
+    layoutNNUE(nn, nn->mem);
+
+    printf("Embedded NNUE loaded\n");
+
+    return 1;
+}
+
+static int mapCache(NNUE* nn, const char* cachePath, const struct stat* source)
+{
+    int fd = open(cachePath, O_RDONLY);
+    if (fd < 0 || !mapBlock(nn, fd))
+        return 0;
+
+    const NNUECacheHeader* h = (const NNUECacheHeader*)nn->mem;
+    if (h->sourceSize != (uint64_t)source->st_size || h->sourceMtime != (int64_t)source->st_mtime)
+    {
+        freeNNUE(nn);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int attachShared(NNUE* nn, const char* name, const uint64_t hash)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0 || !mapBlock(nn, fd))
+        return 0;
+
+    if (((const NNUECacheHeader*)nn->mem)->hash != hash)
+    {
+        freeNNUE(nn);
+        return 0;
+    }
+
+    return 1;
+}
+
+//Everything but the magic, which is set once the copy is complete
+static void fillHeader(const NNUE* nn, const struct stat* source, const uint64_t hash)
+{
+    NNUECacheHeader* h = (NNUECacheHeader*)nn->mem;
+    memset(h, 0, sizeof(NNUECacheHeader));
+    h->version = NNUE_CACHE_VERSION;
+    h->network = NNUEHash;
+    h->size = nn->size;
+    h->sourceSize = source->st_size;
+    h->sourceMtime = source->st_mtime;
+    h->hash = hash;
+}
+
+/* Saves the block of nn as the cache, it is written to a temporary file and renamed
+ * so that no other process can map a partial cache
+ */
+static int writeCache(const NNUE* nn, const char* cachePath)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cachePath, (int)getpid());
+
+    FILE* f = fopen(tmp, "w");
+    if (!f)
+        return 0;
+
+    atomic_store_explicit(&((NNUECacheHeader*)nn->mem)->magic, CacheMagic, memory_order_relaxed);
+    int ok = fwrite(nn->mem, 1, nn->size, f) == nn->size;
+    ok &= fclose(f) == 0;
+
+    if (!ok || rename(tmp, cachePath) != 0)
+    {
+        remove(tmp);
+        return 0;
+    }
+
+    return 1;
 }
 
-NNUE loadNNUE(const char* path)
+/* Copies the block of nn to a new shared memory object, fails if it already exists,
+ * the process that created it may still be filling it
+ */
+static int createShared(const NNUE* nn, const char* name)
+{
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return 0;
+
+    void* mem = MAP_FAILED;
+    if (ftruncate(fd, nn->size) == 0)
+        mem = mmap(NULL, nn->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mem == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return 0;
+    }
+
+    memcpy(mem, nn->mem, nn->size);
+    atomic_store_explicit(&((NNUECacheHeader*)mem)->magic, CacheMagic, memory_order_release);
+    munmap(mem, nn->size);
+
+    return 1;
+}
+
+/* Loads the network in path, if cachePath isn't NULL the cache is mapped when it is valid
+ * and created from the network otherwise. With shared the network is taken from the shared
+ * memory copy with the hash of the file, which is created if no process has done it yet
+ * Both fall back to a private copy. Without a path the embedded network is used
+ * Returns 0 if the file can't be read or isn't a network of this architecture, out is left empty
+ */
+int loadNNUE(NNUE* out, const char* path, const char* cachePath, const int shared)
 {
     assert(sizeof(uint32_t) == 4);
     assert(dimensions[2] == dimensions[3]);
@@ -61,41 +467,111 @@ NNUE loadNNUE(const char* path)
     assert(kHalfDimensionFT == dimensions[1] / 2);
     assert(kHalfDimensionFT == kDimensionFT / 2);
 
-    NNUE nn = (NNUE) {};
+    NNUE nn;
+    struct stat source;
+    char name[64] = "";
+
+    *out = (NNUE) {};
+    if (!path)
+        return loadEmbedded(out);
+
+    if (stat(path, &source) != 0)
+    {
+        fprintf(stderr, "Can't open nnue file: %s\n", path);
+        return 0;
+    }
+
+    if (cachePath && mapCache(&nn, cachePath, &source))
+    {
+        printf("%s NNUE loaded from %s\n", path, cachePath);
+        *out = nn;
+        return 1;
+    }
+
+    const uint64_t hash = (cachePath || shared)? hashFile(path) : 0;
+    if (shared)
+    {
+        snprintf(name, sizeof(name), "/NoC-nnue-%016llx", (unsigned long long)hash);
+        if (attachShared(&nn, name, hash))
+        {
+            printf("%s NNUE loaded from shared memory %s\n", path, name);
+            *out = nn;
+            return 1;
+        }
+    }
 
     FILE* f = fopen(path, "r");
 
     if (!f)
     {
         fprintf(stderr, "Can't open nnue file: %s\n", path);
-        exit(5);
+        return 0;
     }
 
     #ifdef NNUE_DEBUG
         printf("Loading NNUE %s\n", path);
     #endif
 
-    nn.ftBiases = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT);
-    nn.ftWeights = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT*kInputDimensionsFT);
-    CHECK_MALLOC(nn.ftBiases);
-    CHECK_MALLOC(nn.ftWeights);
+    allocNNUE(&nn);
 
-    readHeaders(f);
-    readParams(f, &nn);
+    const int ok = readHeaders(f) && readParams(f, &nn);
 
     fclose(f);
 
+    if (!ok)
+    {
+        fprintf(stderr, "Invalid nnue file: %s\n", path);
+        freeNNUE(&nn);
+        return 0;
+    }
+
     #ifdef NNUE_DEBUG
     if (0)
         showNNUE(&nn);
     #endif
 
+    fillHeader(&nn, &source, hash);
+
+    //The process that creates a copy also maps it, so it shares the pages with the next ones
+    NNUE mapped;
+    if (cachePath)
+    {
+        if (writeCache(&nn, cachePath) && mapCache(&mapped, cachePath, &source))
+        {
+            freeNNUE(&nn);
+            nn = mapped;
+        }
+        else
+            fprintf(stderr, "Can't write the nnue cache: %s\n", cachePath);
+    }
+    else if (shared)
+    {
+        //Another process may be creating it at the same time, it is given some time to finish
+        int created = createShared(&nn, name);
+        int attached = attachShared(&mapped, name, hash);
+        for (int t = 0; !created && !attached && t < SHARED_WAIT; ++t)
+        {
+            usleep(10000);
+            attached = attachShared(&mapped, name, hash);
+        }
+
+        if (attached)
+        {
+            freeNNUE(&nn);
+            nn = mapped;
+        }
+        else
+            fprintf(stderr, "Can't share the nnue, using a private copy. Remove /dev/shm%s if it is stale\n", name);
+    }
+
     printf("%s NNUE loaded\n", path);
 
-    return nn;
+    *out = nn;
+    return 1;
 }
 
-void readHeaders(FILE* f)
+//Returns 0 if the headers aren't the ones of this architecture
+int readHeaders(FILE* f)
 {
     uint32_t version, hash;
     int successfulRead = 1, size;
@@ -104,16 +580,19 @@ void readHeaders(FILE* f)
     successfulRead &= fread(&hash, sizeof(uint32_t), 1, f);
     successfulRead &= fread(&size, sizeof(uint32_t), 1, f);
 
-    assert(version == NNUEVersion);
-    assert(hash == NNUEHash);
-    assert(size == ArchSize);
     CHECK_READ(successfulRead, 1);
+    if (version != NNUEVersion || hash != NNUEHash || size != ArchSize)
+        return 0;
 
     char* architecture = (char*)malloc(ArchSize);
     CHECK_MALLOC(architecture);
 
     successfulRead = fread(architecture, sizeof(char), ArchSize, f);
-    CHECK_READ(successfulRead, ArchSize);
+    if (successfulRead != ArchSize)
+    {
+        free(architecture);
+        return 0;
+    }
 
     #ifdef NNUE_DEBUG
         printf("Version: %u\n", version);
@@ -123,10 +602,12 @@ void readHeaders(FILE* f)
     #endif
 
     free(architecture);
+
+    return 1;
 }
 
-//Code copied from evaluate_nnue
-void readParams(FILE* f, NNUE* nn)
+//Code copied from evaluate_nnue, returns 0 if the file doesn't have exactly the parameters of this architecture
+int readParams(FILE* f, NNUE* nn)
 {
     uint32_t header;
     int successfulRead = 1;
@@ -135,7 +616,8 @@ void readParams(FILE* f, NNUE* nn)
 
     successfulRead = fread(&header, sizeof(uint32_t), 1, f);
     CHECK_READ(successfulRead, 1);
-    assert(header == FTHeader);
+    if (header != FTHeader)
+        return 0;
 
     #ifdef NNUE_DEBUG
         printf("Header_FT: %u\n", header);
@@ -152,7 +634,8 @@ void readParams(FILE* f, NNUE* nn)
 
     successfulRead = fread(&header, sizeof(uint32_t), 1, f);
     CHECK_READ(successfulRead, 1);
-    assert(header == NTHeader);
+    if (header != NTHeader)
+        return 0;
 
     #ifdef NNUE_DEBUG
         printf("Header_Network: %u\n", header);
@@ -160,15 +643,23 @@ void readParams(FILE* f, NNUE* nn)
 
     successfulRead = fread(nn->biases1, sizeof(nn->biases1[0]), dimensions[2], f);
     CHECK_READ(successfulRead, dimensions[3]);
-    readWeights(f, nn->weights1, dimensions[1], 0);
+    if (!readWeights(f, nn->weights1, dimensions[1]))
+        return 0;
+
+    //The sparse variant has its own copy of the input layer
+    for (int i = 0; i < 32; ++i)
+        for (int j = 0; j < dimensions[1]; ++j)
+            nn->weights1Sparse[getIdxSparse(i, j, dimensions[1])] = nn->weights1[i*dimensions[1]+j];
 
     successfulRead = fread(nn->biases2, sizeof(nn->biases2[0]), dimensions[3], f);
     CHECK_READ(successfulRead, dimensions[3]);
-    readWeights(f, nn->weights2, dimensions[2], 0);
+    if (!readWeights(f, nn->weights2, dimensions[2]))
+        return 0;
 
     successfulRead = fread(nn->outputB, sizeof(nn->outputB[0]), dimensions[4], f);
     CHECK_READ(successfulRead, dimensions[4]);
-    readWeights(f, nn->outputW, 1, 1);
+    if (!readWeights(f, nn->outputW, 1))
+        return 0;
 
     int ignore, cnt = 0;
     while (fread(&ignore, sizeof(int), 1, f))
@@ -176,24 +667,19 @@ void readParams(FILE* f, NNUE* nn)
     if (cnt)
     {
         fprintf(stderr, "NNUE file hasn't been read completely, %d ints remain\n", cnt);
-        exit(10);
+        return 0;
     }
+
+    return 1;
 }
 
-void readWeights(FILE* f, weight_t* ws, const int dims, const int isOutput)
+//Every layer is stored by rows, like in the file
+int readWeights(FILE* f, weight_t* ws, const int dims)
 {
-    for (int i = 0; i < 32; ++i)
-    {
-        for (int j = 0; j < dims; ++j)
-        {
-            int8_t a;
-            int s = fread(&a, 1, 1, f);
-            CHECK_READ(s, 1);
-            //Output is the same whether it is sparse or regular
-            int idx = isOutput? i*dims+j : getIdx(i,j,dims);
-            ws[idx] = (weight_t)a;
-        }
-    }
+    int s = fread(ws, sizeof(weight_t), 32*dims, f);
+    CHECK_READ(s, 32*dims);
+
+    return 1;
 }
 
 //TODO: make this a "save nn into binary file" function
@@ -251,8 +737,10 @@ void showNNUE(const NNUE* nn)
 
 void freeNNUE(NNUE* nn)
 {
-    free(nn->ftBiases);
-    free(nn->ftWeights);
+    if (nn->mem && nn->storage != NNUE_EMBEDDED)
+        munmap(nn->mem, nn->size);
+
+    *nn = (NNUE) {};
 }
 
 static inline const int makeIndex(const int c, const int sq, const int pc, const int ksq)
@@ -271,11 +759,9 @@ static inline const int toSf(const int c, const int sq)
 void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t* inp)
 {
     assert(POPCOUNT(b->allPieces) <= 32);
-    int actives[30];
+    const int16_t* rows[MAX_FT_ROWS];
     int numActives = 0;
 
-    memcpy(inp, nn->ftBiases, sizeof(int16_t)*kHalfDimensionFT);
-
     int ksq = toSf(color, LSB_INDEX(b->piece[color][KING]));
 
     for (int c = BLACK; c <= WHITE; ++c)
@@ -287,7 +773,7 @@ void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t*
             while (bb)
             {
                 int sq = toSf(color, LSB_INDEX(bb));
-                actives[numActives++] = makeIndex(color, sq, sfPc, ksq);
+                rows[numActives++] = nn->ftWeights + kHalfDimensionFT * makeIndex(color, sq, sfPc, ksq);
                 REMOVE_LSB(bb);
             }
         }
@@ -295,12 +781,7 @@ void inputLayer(const NNUE* nn, const Board* const b, const int color, int16_t*
 
     assert(numActives == POPCOUNT(b->allPieces)-2);
 
-    for (int i = 0; i < numActives; ++i)
-    {
-        const int offset = kHalfDimensionFT * actives[i];
-        for (int j = 0; j < kHalfDimensionFT; ++j)
-            inp[j] += nn->ftWeights[offset+j];
-    }
+    ftUpdate(inp, nn->ftBiases, rows, numActives, NULL, 0);
 }
 
 void determineChanges(const Move m, NNUEChangeList* list, const int color)
@@ -327,7 +808,35 @@ void determineChanges(const Move m, NNUEChangeList* list, const int color)
         list->changes[list->idx++] = (NNUEChange) {.piece = PAWN, .sqr = m.enPass, .color = 1^color, .appears = 0};
 }
 
-void applyChanges(const NNUE* nn, const Board* b, const NNUEChangeList* list, const int color, int16_t* inp)
+//Index of the first weight of the row of the change
+static inline int changeOffset(const NNUEChange* change, const int color, const int ksq)
+{
+    const int sfPc = (change->color?6:14) - change->piece;
+    const int sq = toSf(color, change->sqr);
+    return kHalfDimensionFT * makeIndex(color, sq, sfPc, ksq);
+}
+
+//Each row is 512B, 8 cache lines, and they are scattered through the 21MB of ftWeights
+static void prefetchChanges(const NNUE* nn, const Board* b, const NNUEChangeList* list)
+{
+    if (list->changes[0].piece == KING)
+        return;
+
+    for (int color = BLACK; color <= WHITE; ++color)
+    {
+        const int ksq = toSf(color, LSB_INDEX(b->piece[color][KING]));
+        for (int i = 0; i < list->idx; ++i)
+        {
+            const int16_t* row = nn->ftWeights + changeOffset(&list->changes[i], color, ksq);
+            for (int j = 0; j < kHalfDimensionFT; j += 64 / sizeof(int16_t))
+                PREFETCH(row + j);
+        }
+    }
+}
+
+/* prev is the accumulator of the parent, it can be the same as inp
+ */
+void applyChanges(const NNUE* nn, const Board* b, const NNUEChangeList* list, const int color, const int16_t* prev, int16_t* inp)
 {
     if (list->changes[0].piece == KING)
     {
@@ -336,66 +845,428 @@ void applyChanges(const NNUE* nn, const Board* b, const NNUEChangeList* list, co
     }
 
     const int ksq = toSf(color, LSB_INDEX(b->piece[color][KING]));
+    const int16_t* add[4];
+    const int16_t* sub[4];
+    int nAdd = 0, nSub = 0;
 
     for (int i = 0; i < list->idx; ++i)
     {
-        const int c = list->changes[i].color;
-        const int sfPc = (c?6:14) - list->changes[i].piece;
-        const int sq = toSf(color, list->changes[i].sqr);
-        const int offset = kHalfDimensionFT * makeIndex(color, sq, sfPc, ksq);
-
+        const int16_t* row = nn->ftWeights + changeOffset(&list->changes[i], color, ksq);
         if (list->changes[i].appears)
+            add[nAdd++] = row;
+        else
+            sub[nSub++] = row;
+    }
+
+    ftUpdate(inp, prev, add, nAdd, sub, nSub);
+}
+
+/* Computes the input layer of color from the refresh entry of its king square,
+ * only the pieces that differ from the ones of the entry are added or removed
+ */
+static void refreshAcc(NNUEStack* st, const int net, const Board* const b, const int color, int16_t* inp)
+{
+    const NNUE* nn = st->nn[net];
+    const int kingSqr = LSB_INDEX(b->piece[color][KING]);
+    const int ksq = toSf(color, kingSqr);
+    NNUERefreshEntry* entry = &st->refresh[net][color][kingSqr];
+    const int16_t* add[MAX_FT_ROWS];
+    const int16_t* sub[MAX_FT_ROWS];
+    int nAdd = 0, nSub = 0;
+
+    for (int c = BLACK; c <= WHITE; ++c)
+    {
+        for (int piece = QUEEN; piece <= PAWN; ++piece)
         {
-            for (int j = 0; j < kHalfDimensionFT; ++j)
-                inp[j] += nn->ftWeights[offset+j];
+            const int sfPc = (c==WHITE? 6 : 14) - piece;
+            uint64_t added = b->piece[c][piece] & ~entry->piece[c][piece];
+            uint64_t removed = entry->piece[c][piece] & ~b->piece[c][piece];
+
+            while (added)
+            {
+                add[nAdd++] = nn->ftWeights + kHalfDimensionFT * makeIndex(color, toSf(color, LSB_INDEX(added)), sfPc, ksq);
+                REMOVE_LSB(added);
+            }
+            while (removed)
+            {
+                sub[nSub++] = nn->ftWeights + kHalfDimensionFT * makeIndex(color, toSf(color, LSB_INDEX(removed)), sfPc, ksq);
+                REMOVE_LSB(removed);
+            }
+
+            entry->piece[c][piece] = b->piece[c][piece];
         }
-        else
+    }
+
+    ftUpdate(entry->acc, entry->acc, add, nAdd, sub, nSub);
+    memcpy(inp, entry->acc, sizeof(int16_t)*kHalfDimensionFT);
+}
+
+//The refresh entries start as an empty board, so they are valid for the network net of st
+static void resetRefresh(NNUEStack* st, const int net)
+{
+    for (int color = BLACK; color <= WHITE; ++color)
+    {
+        for (int sq = 0; sq < 64; ++sq)
         {
-            for (int j = 0; j < kHalfDimensionFT; ++j)
-                inp[j] -= nn->ftWeights[offset+j];
+            memcpy(st->refresh[net][color][sq].acc, st->nn[net]->ftBiases, sizeof(int16_t)*kHalfDimensionFT);
+            memset(st->refresh[net][color][sq].piece, 0, sizeof(st->refresh[net][color][sq].piece));
         }
     }
 }
 
-void initNNUEAcc(const Board* b)
+/* The accumulators belong to the caller (one stack per search thread), the weights are shared
+ * The root is computed for every network, so a line never has to be walked back further
+ */
+void initNNUEAcc(const Board* b, NNUEStack* st)
 {
     #ifdef USE_NNUE
-    inputLayer(&nnue, b, WHITE, nInput);
-    inputLayer(&nnue, b, BLACK, nInput + kHalfDimensionFT);
+    NNUEAccumulator* root = &st->stack[0];
+    st->top = 0;
+    st->overflow = 0;
+
+    for (int net = NNUE_MAIN; net < NNUE_NETS; ++net)
+    {
+        root->computed[net] = st->nn[net] != NULL;
+        if (!st->nn[net])
+            continue;
+
+        refreshAcc(st, net, b, WHITE, root->acc[net]);
+        refreshAcc(st, net, b, BLACK, root->acc[net] + kHalfDimensionFT);
+    }
     #endif
 }
 
-void updateDo(NNUEChangeList* q, const Move m, const Board* b)
+/* b is the board after the move has been made, only the changes are recorded
+ */
+void updateDo(NNUEStack* st, const Move m, const Board* b)
 {
     #ifdef USE_NNUE
-    determineChanges(m, q, 1^b->stm);
+    if (st->top == ACC_STACK_SIZE - 1)
+    {
+        st->overflow++;
+        return;
+    }
 
-    applyChanges(&nnue, b, q, WHITE, nInput);
-    applyChanges(&nnue, b, q, BLACK, nInput+kHalfDimensionFT);
-    assert(q->idx < 5);
+    NNUEAccumulator* acc = &st->stack[++st->top];
+    acc->list.idx = 0;
+    acc->computed[NNUE_MAIN] = acc->computed[NNUE_ENDGAME] = 0;
+    determineChanges(m, &acc->list, 1^b->stm);
+    assert(acc->list.idx < 5);
     #endif
 }
 
-void updateUndo(NNUEChangeList* q, const Board* b)
+void updateUndo(NNUEStack* st)
 {
     #ifdef USE_NNUE
-    assert(q->idx < 5);
+    if (st->overflow)
+        st->overflow--;
+    else
+        st->top--;
+    assert(st->top >= 0);
+    #endif
+}
+
+/* Walks back to the closest accumulator computed for net and applies the changes from there on,
+ * the positions in between are left computed for the siblings. If a king moved the deltas
+ * are useless and the current position is refreshed from the refresh entries instead
+ */
+static const int16_t* materialize(NNUEStack* st, const int net, const Board* b)
+{
+    NNUEAccumulator* curr = &st->stack[st->top];
+    if (curr->computed[net])
+        return curr->acc[net];
+
+    int i = st->top;
+    while (!st->stack[i].computed[net] && st->stack[i].list.changes[0].piece != KING)
+        --i;
+    assert(i >= 0);
+
+    if (!st->stack[i].computed[net])
+    {
+        refreshAcc(st, net, b, WHITE, curr->acc[net]);
+        refreshAcc(st, net, b, BLACK, curr->acc[net] + kHalfDimensionFT);
+        curr->computed[net] = 1;
+        return curr->acc[net];
+    }
+
+    //There is no king move in between, so the king squares of b are valid for every change
+    //The rows of every pending ply are requested before the first one is applied
+    for (int j = i + 1; j <= st->top; ++j)
+        prefetchChanges(st->nn[net], b, &st->stack[j].list);
+
+    for (++i; i <= st->top; ++i)
+    {
+        const int16_t* prev = st->stack[i-1].acc[net];
+        int16_t* acc = st->stack[i].acc[net];
+        applyChanges(st->nn[net], b, &st->stack[i].list, WHITE, prev, acc);
+        applyChanges(st->nn[net], b, &st->stack[i].list, BLACK, prev + kHalfDimensionFT, acc + kHalfDimensionFT);
+        st->stack[i].computed[net] = 1;
+    }
+
+    return curr->acc[net];
+}
+
+/* Propagates the accumulator through the hidden layers, hidden1 and hidden2 are their outputs
+ */
+int32_t forward(const NNUE* nn, const int16_t* nInput, const int stm, clipped_t* hidden1, clipped_t* hidden2)
+{
+    if (atomic_load_explicit(&variant, memory_order_relaxed) == VARIANT_SPARSE)
+        return forwardSparse(nn, nInput, stm, hidden1, hidden2);
+    return forwardRegular(nn, nInput, stm, hidden1, hidden2);
+}
+
+int evaluate(const NNUE* nn, const Board* b, int16_t* nInput)
+{
+    inputLayer(nn, b, WHITE, nInput);
+    inputLayer(nn, b, BLACK, nInput+kHalfDimensionFT);
 
-    for (int i = 0; i < q->idx; ++i)
-        q->changes[i].appears ^= 1;
+    clipped_t hiddenLayer1[kDimensionHidden];
+    clipped_t hiddenLayer2[kDimensionHidden];
 
-    applyChanges(&nnue, b, q, WHITE, nInput);
-    applyChanges(&nnue, b, q, BLACK, nInput+kHalfDimensionFT);
-    q->idx = 0;
+    return forward(nn, nInput, b->stm, hiddenLayer1, hiddenLayer2) / FV_SCALE;
+}
+
+//#define TEST_ACC
+
+int evaluateAcc(const NNUE* nn, const Board* const b, const int16_t* nInput)
+{
+    #ifdef TEST_ACC
+    int16_t testInput[kDimensionFT];
+    inputLayer(nn, b, WHITE, testInput);
+    inputLayer(nn, b, BLACK, testInput+kHalfDimensionFT);
+
+    for (int i = 0; i < kDimensionFT; ++i)
+        assert(testInput[i] == nInput[i]);
     #endif
+
+    clipped_t hiddenLayer1[kDimensionHidden];
+    clipped_t hiddenLayer2[kDimensionHidden];
+
+    return forward(nn, nInput, b->stm, hiddenLayer1, hiddenLayer2) / FV_SCALE;
 }
 
-int evaluateNNUE(const Board* const b, const int useAcc)
+/* The network is chosen per position by its number of pieces
+ * If st is NULL the input layer is computed from scratch with the current networks
+ */
+int evaluateNNUE(const Board* const b, NNUEStack* st)
 {
     int ev;
-    if (useAcc)
-        ev = evaluateAcc(&nnue, b, nInput);
+    if (st && !st->overflow)
+    {
+        const int net = netOf(st, b);
+        ev = evaluateAcc(st->nn[net], b, materialize(st, net, b));
+    }
+    else if (st)
+    {
+        int16_t nInput[kDimensionFT];
+        ev = evaluate(st->nn[netOf(st, b)], b, nInput);
+    }
     else
-        ev = evaluate(&nnue, b, nInput);
+    {
+        int16_t nInput[kDimensionFT];
+        const NNUE* nn = NULL;
+        if (POPCOUNT(b->allPieces) <= endgamePieces)
+            nn = acquireNNUE(NNUE_ENDGAME);
+        if (!nn)
+            nn = acquireNNUE(NNUE_MAIN);
+        ev = evaluate(nn, b, nInput);
+        releaseNNUE(nn);
+    }
     return ev;
 }
+
+/* Evaluates n unrelated positions with the network of st, which has been attached
+ * The accumulators are built from the refresh entries, which are kept between calls, so consecutive
+ * positions of a game only read the weights of the pieces that differ, and the hidden layers stay in cache
+ */
+void evaluateBatch(NNUEStack* st, const Board* boards, const int n, int* evals)
+{
+    #ifdef USE_NNUE
+    for (int i = 0; i < n; ++i)
+    {
+        const int net = netOf(st, &boards[i]);
+        int16_t* acc = st->stack[0].acc[net];
+        refreshAcc(st, net, &boards[i], WHITE, acc);
+        refreshAcc(st, net, &boards[i], BLACK, acc + kHalfDimensionFT);
+        evals[i] = evaluateAcc(st->nn[net], &boards[i], acc);
+    }
+    st->stack[0].computed[NNUE_MAIN] = st->stack[0].computed[NNUE_ENDGAME] = 0;
+    #endif
+}
+
+/* Plays a random legal move, the game starts again when it ends or gets too long
+ */
+static void randomMove(Board* b, int* ply, uint64_t* seed)
+{
+    Move list[NMOVES];
+    History h;
+
+    int numMoves = legalMoves(b, list) >> 1;
+    if (!numMoves || *ply >= 120)
+    {
+        *b = defaultBoard();
+        *ply = 0;
+        numMoves = legalMoves(b, list) >> 1;
+    }
+
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    makeMove(b, list[*seed % numMoves], &h);
+    ++*ply;
+}
+
+//The hidden layers of variant v, whichever one forward() uses
+static int32_t forwardVariant(const int v, const NNUE* nn, const int16_t* nInput, const int stm, clipped_t* hidden1, clipped_t* hidden2)
+{
+    return v == VARIANT_SPARSE? forwardSparse(nn, nInput, stm, hidden1, hidden2)
+                              : forwardRegular(nn, nInput, stm, hidden1, hidden2);
+}
+
+/* Evaluates positions of random games with both variants and the kernels of every level the cpu supports,
+ * the accumulator and each layer are compared with the scalar regular ones. Returns 1 if they all match
+ */
+int nnueSelfCheck(const int positions)
+{
+    const int original = simdLevel();
+    const NNUE* nn = acquireNNUE(NNUE_MAIN);
+    int mismatches[SIMD_LEVELS][VARIANT_SPARSE + 1] = {{0}};
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+    Board b = defaultBoard();
+    int ply = 0;
+
+    int16_t refAcc[kDimensionFT], acc[kDimensionFT];
+    clipped_t refHidden1[kDimensionHidden], refHidden2[kDimensionHidden];
+    clipped_t hidden1[kDimensionHidden], hidden2[kDimensionHidden];
+
+    for (int p = 0; p < positions; ++p)
+    {
+        randomMove(&b, &ply, &seed);
+
+        setSimd(SIMD_SCALAR);
+        inputLayer(nn, &b, WHITE, refAcc);
+        inputLayer(nn, &b, BLACK, refAcc + kHalfDimensionFT);
+        const int32_t refOut = forwardRegular(nn, refAcc, b.stm, refHidden1, refHidden2);
+
+        for (int l = SIMD_SCALAR; l < SIMD_LEVELS; ++l)
+        {
+            if (!setSimd(l))
+                continue;
+
+            inputLayer(nn, &b, WHITE, acc);
+            inputLayer(nn, &b, BLACK, acc + kHalfDimensionFT);
+
+            for (int v = VARIANT_REGULAR; v <= VARIANT_SPARSE; ++v)
+            {
+                const int32_t out = forwardVariant(v, nn, acc, b.stm, hidden1, hidden2);
+                if (out != refOut || memcmp(acc, refAcc, sizeof(acc))
+                    || memcmp(hidden1, refHidden1, sizeof(hidden1)) || memcmp(hidden2, refHidden2, sizeof(hidden2)))
+                    mismatches[l][v]++;
+            }
+        }
+    }
+
+    setSimd(original);
+    releaseNNUE(nn);
+
+    int passes = 1;
+    for (int l = SIMD_SCALAR; l < SIMD_LEVELS; ++l)
+    {
+        if (!simdSupported(l))
+            continue;
+        printf("info string nnuecheck %s positions %d mismatches regular %d sparse %d\n", simdName(l), positions,
+            mismatches[l][VARIANT_REGULAR], mismatches[l][VARIANT_SPARSE]);
+        passes &= mismatches[l][VARIANT_REGULAR] == 0 && mismatches[l][VARIANT_SPARSE] == 0;
+    }
+
+    return passes;
+}
+
+#define CALIBRATION_POSITIONS 256
+#define CALIBRATION_ROUNDS 16
+
+static const char* variantName(const int v)
+{
+    switch (v)
+    {
+        case VARIANT_REGULAR: return "regular";
+        case VARIANT_SPARSE: return "sparse";
+        default: return "auto";
+    }
+}
+
+/* Times the hidden layers of both variants on the same positions of random games,
+ * the fastest round of each one counts. ns is the time per evaluation, indexed by variant
+ */
+static void calibrate(double* ns)
+{
+    const NNUE* nn = acquireNNUE(NNUE_MAIN);
+    int16_t (*accs)[kDimensionFT] = malloc(CALIBRATION_POSITIONS * sizeof(*accs));
+    int stms[CALIBRATION_POSITIONS];
+    CHECK_MALLOC(accs);
+
+    uint64_t seed = 0x2545f4914f6cdd1dULL;
+    Board b = defaultBoard();
+    int ply = 0;
+    for (int p = 0; p < CALIBRATION_POSITIONS; ++p)
+    {
+        randomMove(&b, &ply, &seed);
+        inputLayer(nn, &b, WHITE, accs[p]);
+        inputLayer(nn, &b, BLACK, accs[p] + kHalfDimensionFT);
+        stms[p] = b.stm;
+    }
+
+    clipped_t hidden1[kDimensionHidden], hidden2[kDimensionHidden];
+    volatile int32_t sink = 0;
+    ns[VARIANT_REGULAR] = ns[VARIANT_SPARSE] = 1e18;
+
+    for (int r = 0; r < CALIBRATION_ROUNDS; ++r)
+    {
+        for (int v = VARIANT_REGULAR; v <= VARIANT_SPARSE; ++v)
+        {
+            const clock_t start = getTime();
+            for (int p = 0; p < CALIBRATION_POSITIONS; ++p)
+                sink += forwardVariant(v, nn, accs[p], stms[p], hidden1, hidden2);
+            const double elapsed = (double)(getTime() - start) * 1e9 / CLOCKS_PER_SEC / CALIBRATION_POSITIONS;
+            if (elapsed < ns[v])
+                ns[v] = elapsed;
+        }
+    }
+
+    free(accs);
+    releaseNNUE(nn);
+}
+
+/* Times both variants, with the NNUEKernel option on auto the fastest one is used from now on
+ */
+void benchNNUE(void)
+{
+    double ns[3];
+    calibrate(ns);
+
+    if (requestedVariant == VARIANT_AUTO)
+        atomic_store(&variant, ns[VARIANT_SPARSE] <= ns[VARIANT_REGULAR]? VARIANT_SPARSE : VARIANT_REGULAR);
+
+    printf("info string NNUE regular %.0fns sparse %.0fns per evaluation\n", ns[VARIANT_REGULAR], ns[VARIANT_SPARSE]);
+    printf("info string NNUE kernel %s %s%s\n", variantName(atomic_load(&variant)), simdName(simdLevel()),
+        requestedVariant == VARIANT_AUTO? " (fastest)" : "");
+    fflush(stdout);
+}
+
+/* VARIANT_AUTO measures both and keeps the fastest
+ */
+void setNNUEVariant(const int v)
+{
+    requestedVariant = v;
+    variantSet = 1;
+    if (v == VARIANT_AUTO)
+    {
+        benchNNUE();
+        return;
+    }
+
+    atomic_store(&variant, v);
+    printf("info string NNUE kernel %s %s\n", variantName(v), simdName(simdLevel()));
+    fflush(stdout);
+}
@@ -0,0 +1,577 @@
+/* nnuesimd.c
+ * Vectorized kernels of the NNUE, there is a scalar version of each one and the best one
+ * the cpu supports is chosen at startup, so a binary compiled without -march=native runs everywhere
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+#include "../include/global.h"
+#include "../include/board.h"
+#include "../include/moves.h"
+#include "../include/nnue.h"
+#include "../include/nnuearch.h"
+#include "../include/nnuesimd.h"
+
+typedef void (*FtUpdate)(int16_t*, const int16_t*, const int16_t* const*, const int, const int16_t* const*, const int);
+typedef void (*ClipAcc)(const int16_t*, int8_t*, const int);
+typedef void (*ClipHidden)(const int32_t*, int8_t*, const int);
+typedef void (*Affine)(const int8_t*, const int, const int8_t*, const int32_t*, int32_t*);
+
+typedef struct
+{
+    FtUpdate ftUpdate;
+    ClipAcc clipAcc;
+    ClipHidden clipHidden;
+    Affine affine;
+    Affine affineSparse;
+} Kernels;
+
+#define CHUNK_SIZE 4 //Inputs of a chunk of the sparse layer, 4 int8 are an int32
+#define CHUNK_WEIGHTS (CHUNK_SIZE * kDimensionHidden)
+
+//nnzLookup[mask] are the positions of the set bits of mask
+static uint16_t nnzLookup[256][8];
+
+static void ftUpdateScalar(int16_t* out, const int16_t* in, const int16_t* const* add, const int nAdd, const int16_t* const* sub, const int nSub)
+{
+    for (int j = 0; j < kHalfDimensionFT; ++j)
+        out[j] = in[j];
+
+    for (int i = 0; i < nAdd; ++i)
+        for (int j = 0; j < kHalfDimensionFT; ++j)
+            out[j] += add[i][j];
+
+    for (int i = 0; i < nSub; ++i)
+        for (int j = 0; j < kHalfDimensionFT; ++j)
+            out[j] -= sub[i][j];
+}
+
+static void clipAccScalar(const int16_t* in, int8_t* out, const int n)
+{
+    for (int i = 0; i < n; ++i)
+        out[i] = clip(in[i]);
+}
+
+static void clipHiddenScalar(const int32_t* in, int8_t* out, const int n)
+{
+    for (int i = 0; i < n; ++i)
+        out[i] = clip64(in[i]);
+}
+
+static void affineScalar(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    for (int i = 0; i < kDimensionHidden; ++i)
+    {
+        int32_t sum = bs[i];
+        for (int j = 0; j < inDim; ++j)
+            sum += in[j] * ws[i*inDim+j];
+        out[i] = sum;
+    }
+}
+
+static void affineSparseScalar(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    for (int i = 0; i < kDimensionHidden; ++i)
+        out[i] = bs[i];
+
+    for (int c = 0; c < inDim; c += CHUNK_SIZE)
+    {
+        if (!(in[c] | in[c+1] | in[c+2] | in[c+3]))
+            continue;
+
+        const int8_t* w = ws + (c / CHUNK_SIZE) * CHUNK_WEIGHTS;
+        for (int i = 0; i < kDimensionHidden; ++i)
+            for (int k = 0; k < CHUNK_SIZE; ++k)
+                out[i] += in[c+k] * w[i*CHUNK_SIZE+k];
+    }
+}
+
+#ifdef SIMD_X86
+
+/* The accumulator is split in tiles that fit in the registers, every row of the update
+ * is added to the tile before it is stored
+ */
+#define SSE2_REGS 8
+#define SSE2_TILE (SSE2_REGS * 8)
+#define AVX2_REGS 8
+#define AVX2_TILE (AVX2_REGS * 16)
+
+__attribute__((target("sse2")))
+static void ftUpdateSse2(int16_t* out, const int16_t* in, const int16_t* const* add, const int nAdd, const int16_t* const* sub, const int nSub)
+{
+    __m128i regs[SSE2_REGS];
+
+    for (int t = 0; t < kHalfDimensionFT; t += SSE2_TILE)
+    {
+        for (int r = 0; r < SSE2_REGS; ++r)
+            regs[r] = _mm_loadu_si128((const __m128i*)(in + t) + r);
+
+        for (int i = 0; i < nAdd; ++i)
+        {
+            const __m128i* row = (const __m128i*)(add[i] + t);
+            for (int r = 0; r < SSE2_REGS; ++r)
+                regs[r] = _mm_add_epi16(regs[r], _mm_loadu_si128(row + r));
+        }
+        for (int i = 0; i < nSub; ++i)
+        {
+            const __m128i* row = (const __m128i*)(sub[i] + t);
+            for (int r = 0; r < SSE2_REGS; ++r)
+                regs[r] = _mm_sub_epi16(regs[r], _mm_loadu_si128(row + r));
+        }
+
+        for (int r = 0; r < SSE2_REGS; ++r)
+            _mm_storeu_si128((__m128i*)(out + t) + r, regs[r]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void ftUpdateAvx2(int16_t* out, const int16_t* in, const int16_t* const* add, const int nAdd, const int16_t* const* sub, const int nSub)
+{
+    __m256i regs[AVX2_REGS];
+
+    for (int t = 0; t < kHalfDimensionFT; t += AVX2_TILE)
+    {
+        for (int r = 0; r < AVX2_REGS; ++r)
+            regs[r] = _mm256_loadu_si256((const __m256i*)(in + t) + r);
+
+        for (int i = 0; i < nAdd; ++i)
+        {
+            const __m256i* row = (const __m256i*)(add[i] + t);
+            for (int r = 0; r < AVX2_REGS; ++r)
+                regs[r] = _mm256_add_epi16(regs[r], _mm256_loadu_si256(row + r));
+        }
+        for (int i = 0; i < nSub; ++i)
+        {
+            const __m256i* row = (const __m256i*)(sub[i] + t);
+            for (int r = 0; r < AVX2_REGS; ++r)
+                regs[r] = _mm256_sub_epi16(regs[r], _mm256_loadu_si256(row + r));
+        }
+
+        for (int r = 0; r < AVX2_REGS; ++r)
+            _mm256_storeu_si256((__m256i*)(out + t) + r, regs[r]);
+    }
+}
+
+/* Negative values are set to 0 before packing, the saturation of the pack does the rest
+ */
+__attribute__((target("sse2")))
+static void clipAccSse2(const int16_t* in, int8_t* out, const int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < n; i += 16)
+    {
+        const __m128i a = _mm_max_epi16(_mm_loadu_si128((const __m128i*)(in + i)), zero);
+        const __m128i b = _mm_max_epi16(_mm_loadu_si128((const __m128i*)(in + i + 8)), zero);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi16(a, b));
+    }
+}
+
+/* v >> SHIFT is saturated to int16 and then to int8, so everything over 127 << SHIFT is 127
+ */
+__attribute__((target("sse2")))
+static void clipHiddenSse2(const int32_t* in, int8_t* out, const int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < n; i += 16)
+    {
+        const __m128i* v = (const __m128i*)(in + i);
+        const __m128i a = _mm_packs_epi32(_mm_srai_epi32(_mm_loadu_si128(v), SHIFT), _mm_srai_epi32(_mm_loadu_si128(v + 1), SHIFT));
+        const __m128i b = _mm_packs_epi32(_mm_srai_epi32(_mm_loadu_si128(v + 2), SHIFT), _mm_srai_epi32(_mm_loadu_si128(v + 3), SHIFT));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi16(_mm_max_epi16(a, zero), _mm_max_epi16(b, zero)));
+    }
+}
+
+__attribute__((target("avx2")))
+static void clipAccAvx2(const int16_t* in, int8_t* out, const int n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    for (int i = 0; i < n; i += 32)
+    {
+        const __m256i a = _mm256_max_epi16(_mm256_loadu_si256((const __m256i*)(in + i)), zero);
+        const __m256i b = _mm256_max_epi16(_mm256_loadu_si256((const __m256i*)(in + i + 16)), zero);
+        //The pack works within each 128 bit lane
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xd8));
+    }
+}
+
+__attribute__((target("avx2")))
+static void clipHiddenAvx2(const int32_t* in, int8_t* out, const int n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (int i = 0; i < n; i += 32)
+    {
+        const __m256i* v = (const __m256i*)(in + i);
+        const __m256i a = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_loadu_si256(v), SHIFT), _mm256_srai_epi32(_mm256_loadu_si256(v + 1), SHIFT));
+        const __m256i b = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_loadu_si256(v + 2), SHIFT), _mm256_srai_epi32(_mm256_loadu_si256(v + 3), SHIFT));
+        const __m256i packed = _mm256_packs_epi16(_mm256_max_epi16(a, zero), _mm256_max_epi16(b, zero));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+}
+
+/* The inputs are in [0, 127], so the pairs added by maddubs are in [-32512, 32258]
+ * and never saturate, the result is the same as the scalar one
+ * Four rows are computed at once and reduced together with hadd
+ */
+__attribute__((target("ssse3")))
+static void affineSsse3(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const int8_t* w = ws + i*inDim;
+        __m128i s0 = _mm_setzero_si128(), s1 = s0, s2 = s0, s3 = s0;
+        for (int j = 0; j < inDim; j += 16)
+        {
+            const __m128i x = _mm_loadu_si128((const __m128i*)(in + j));
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_loadu_si128((const __m128i*)(w + j))), ones));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_loadu_si128((const __m128i*)(w + inDim + j))), ones));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_loadu_si128((const __m128i*)(w + 2*inDim + j))), ones));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_loadu_si128((const __m128i*)(w + 3*inDim + j))), ones));
+        }
+        s0 = _mm_hadd_epi32(_mm_hadd_epi32(s0, s1), _mm_hadd_epi32(s2, s3));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi32(s0, _mm_loadu_si128((const __m128i*)(bs + i))));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m128i haddx4(__m256i s0, __m256i s1, __m256i s2, __m256i s3)
+{
+    s0 = _mm256_hadd_epi32(_mm256_hadd_epi32(s0, s1), _mm256_hadd_epi32(s2, s3));
+    return _mm_add_epi32(_mm256_castsi256_si128(s0), _mm256_extracti128_si256(s0, 1));
+}
+
+__attribute__((target("avx2")))
+static void affineAvx2(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const int8_t* w = ws + i*inDim;
+        __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+        for (int j = 0; j < inDim; j += 32)
+        {
+            const __m256i x = _mm256_loadu_si256((const __m256i*)(in + j));
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w + j))), ones));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w + inDim + j))), ones));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w + 2*inDim + j))), ones));
+            s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256((const __m256i*)(w + 3*inDim + j))), ones));
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi32(haddx4(s0, s1, s2, s3), _mm_loadu_si128((const __m128i*)(bs + i))));
+    }
+}
+
+/* dpbusd adds the four u8 * s8 products straight into int32, AVX-VNNI and AVX512-VNNI only differ in the encoding
+ */
+__attribute__((target("avx2,avxvnni")))
+static void affineAvxVnni(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const int8_t* w = ws + i*inDim;
+        __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+        for (int j = 0; j < inDim; j += 32)
+        {
+            const __m256i x = _mm256_loadu_si256((const __m256i*)(in + j));
+            s0 = _mm256_dpbusd_avx_epi32(s0, x, _mm256_loadu_si256((const __m256i*)(w + j)));
+            s1 = _mm256_dpbusd_avx_epi32(s1, x, _mm256_loadu_si256((const __m256i*)(w + inDim + j)));
+            s2 = _mm256_dpbusd_avx_epi32(s2, x, _mm256_loadu_si256((const __m256i*)(w + 2*inDim + j)));
+            s3 = _mm256_dpbusd_avx_epi32(s3, x, _mm256_loadu_si256((const __m256i*)(w + 3*inDim + j)));
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi32(haddx4(s0, s1, s2, s3), _mm_loadu_si128((const __m128i*)(bs + i))));
+    }
+}
+
+__attribute__((target("avx2,avx512vnni,avx512vl")))
+static void affineAvx512Vnni(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    for (int i = 0; i < kDimensionHidden; i += 4)
+    {
+        const int8_t* w = ws + i*inDim;
+        __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+        for (int j = 0; j < inDim; j += 32)
+        {
+            const __m256i x = _mm256_loadu_si256((const __m256i*)(in + j));
+            s0 = _mm256_dpbusd_epi32(s0, x, _mm256_loadu_si256((const __m256i*)(w + j)));
+            s1 = _mm256_dpbusd_epi32(s1, x, _mm256_loadu_si256((const __m256i*)(w + inDim + j)));
+            s2 = _mm256_dpbusd_epi32(s2, x, _mm256_loadu_si256((const __m256i*)(w + 2*inDim + j)));
+            s3 = _mm256_dpbusd_epi32(s3, x, _mm256_loadu_si256((const __m256i*)(w + 3*inDim + j)));
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_add_epi32(haddx4(s0, s1, s2, s3), _mm_loadu_si128((const __m128i*)(bs + i))));
+    }
+}
+
+/* Writes the indices of the nonzero chunks of in to nnz and returns how many there are.
+ * The inputs are in [0, 127] so a chunk is nonzero iff it is > 0 as an int32.
+ * Up to 8 indices past the count are written, nnz needs room for them
+ */
+__attribute__((target("sse2")))
+static int findNnzSse2(const int8_t* in, const int inDim, uint16_t* nnz)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i increment = _mm_set1_epi16(8);
+    __m128i base = zero;
+    int count = 0;
+
+    for (int j = 0; j < inDim; j += 8 * CHUNK_SIZE)
+    {
+        const __m128i a = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(in + j)), zero);
+        const __m128i b = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)(in + j + 16)), zero);
+        const int mask = _mm_movemask_ps(_mm_castsi128_ps(a)) | (_mm_movemask_ps(_mm_castsi128_ps(b)) << 4);
+
+        _mm_storeu_si128((__m128i*)(nnz + count), _mm_add_epi16(base, _mm_loadu_si128((const __m128i*)nnzLookup[mask])));
+        count += POPCOUNT(mask);
+        base = _mm_add_epi16(base, increment);
+    }
+
+    return count;
+}
+
+__attribute__((target("avx2")))
+static int findNnzAvx2(const int8_t* in, const int inDim, uint16_t* nnz)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m128i increment = _mm_set1_epi16(8);
+    __m128i base = _mm_setzero_si128();
+    int count = 0;
+
+    for (int j = 0; j < inDim; j += 8 * CHUNK_SIZE)
+    {
+        const __m256i x = _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)(in + j)), zero);
+        const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(x));
+
+        _mm_storeu_si128((__m128i*)(nnz + count), _mm_add_epi16(base, _mm_loadu_si128((const __m128i*)nnzLookup[mask])));
+        count += POPCOUNT(mask);
+        base = _mm_add_epi16(base, increment);
+    }
+
+    return count;
+}
+
+static inline int32_t readChunk(const int8_t* in, const int chunk)
+{
+    int32_t v;
+    memcpy(&v, in + chunk * CHUNK_SIZE, sizeof(v));
+    return v;
+}
+
+/* The chunk is broadcast and multiplied with its column of weights, which holds the 4 weights
+ * of every output, so each 32 bit lane ends with the contribution of the chunk to one output
+ */
+__attribute__((target("ssse3")))
+static void affineSparseSsse3(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    uint16_t nnz[kDimensionFT / CHUNK_SIZE + 8];
+    const int count = findNnzSse2(in, inDim, nnz);
+    const __m128i ones = _mm_set1_epi16(1);
+
+    __m128i acc[kDimensionHidden / 4];
+    for (int r = 0; r < kDimensionHidden / 4; ++r)
+        acc[r] = _mm_loadu_si128((const __m128i*)bs + r);
+
+    for (int k = 0; k < count; ++k)
+    {
+        const __m128i x = _mm_set1_epi32(readChunk(in, nnz[k]));
+        const __m128i* w = (const __m128i*)(ws + nnz[k] * CHUNK_WEIGHTS);
+        for (int r = 0; r < kDimensionHidden / 4; ++r)
+            acc[r] = _mm_add_epi32(acc[r], _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_loadu_si128(w + r)), ones));
+    }
+
+    for (int r = 0; r < kDimensionHidden / 4; ++r)
+        _mm_storeu_si128((__m128i*)out + r, acc[r]);
+}
+
+__attribute__((target("avx2")))
+static void affineSparseAvx2(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    uint16_t nnz[kDimensionFT / CHUNK_SIZE + 8];
+    const int count = findNnzAvx2(in, inDim, nnz);
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    __m256i acc[kDimensionHidden / 8];
+    for (int r = 0; r < kDimensionHidden / 8; ++r)
+        acc[r] = _mm256_loadu_si256((const __m256i*)bs + r);
+
+    for (int k = 0; k < count; ++k)
+    {
+        const __m256i x = _mm256_set1_epi32(readChunk(in, nnz[k]));
+        const __m256i* w = (const __m256i*)(ws + nnz[k] * CHUNK_WEIGHTS);
+        for (int r = 0; r < kDimensionHidden / 8; ++r)
+            acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(_mm256_maddubs_epi16(x, _mm256_loadu_si256(w + r)), ones));
+    }
+
+    for (int r = 0; r < kDimensionHidden / 8; ++r)
+        _mm256_storeu_si256((__m256i*)out + r, acc[r]);
+}
+
+__attribute__((target("avx2,avxvnni")))
+static void affineSparseAvxVnni(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    uint16_t nnz[kDimensionFT / CHUNK_SIZE + 8];
+    const int count = findNnzAvx2(in, inDim, nnz);
+
+    __m256i acc[kDimensionHidden / 8];
+    for (int r = 0; r < kDimensionHidden / 8; ++r)
+        acc[r] = _mm256_loadu_si256((const __m256i*)bs + r);
+
+    for (int k = 0; k < count; ++k)
+    {
+        const __m256i x = _mm256_set1_epi32(readChunk(in, nnz[k]));
+        const __m256i* w = (const __m256i*)(ws + nnz[k] * CHUNK_WEIGHTS);
+        for (int r = 0; r < kDimensionHidden / 8; ++r)
+            acc[r] = _mm256_dpbusd_avx_epi32(acc[r], x, _mm256_loadu_si256(w + r));
+    }
+
+    for (int r = 0; r < kDimensionHidden / 8; ++r)
+        _mm256_storeu_si256((__m256i*)out + r, acc[r]);
+}
+
+__attribute__((target("avx2,avx512vnni,avx512vl")))
+static void affineSparseAvx512Vnni(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    uint16_t nnz[kDimensionFT / CHUNK_SIZE + 8];
+    const int count = findNnzAvx2(in, inDim, nnz);
+
+    __m256i acc[kDimensionHidden / 8];
+    for (int r = 0; r < kDimensionHidden / 8; ++r)
+        acc[r] = _mm256_loadu_si256((const __m256i*)bs + r);
+
+    for (int k = 0; k < count; ++k)
+    {
+        const __m256i x = _mm256_set1_epi32(readChunk(in, nnz[k]));
+        const __m256i* w = (const __m256i*)(ws + nnz[k] * CHUNK_WEIGHTS);
+        for (int r = 0; r < kDimensionHidden / 8; ++r)
+            acc[r] = _mm256_dpbusd_epi32(acc[r], x, _mm256_loadu_si256(w + r));
+    }
+
+    for (int r = 0; r < kDimensionHidden / 8; ++r)
+        _mm256_storeu_si256((__m256i*)out + r, acc[r]);
+}
+
+#endif
+
+static int level = SIMD_SCALAR;
+static Kernels kernels = {ftUpdateScalar, clipAccScalar, clipHiddenScalar, affineScalar, affineSparseScalar};
+
+int simdSupported(const int l)
+{
+    if (l == SIMD_SCALAR)
+        return 1;
+
+    #ifdef SIMD_X86
+    __builtin_cpu_init();
+    switch (l)
+    {
+        case SIMD_SSE2: return __builtin_cpu_supports("sse2");
+        case SIMD_SSSE3: return __builtin_cpu_supports("ssse3");
+        case SIMD_AVX2: return __builtin_cpu_supports("avx2");
+        case SIMD_VNNI: return __builtin_cpu_supports("avx2")
+            && (__builtin_cpu_supports("avxvnni") || (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")));
+    }
+    #endif
+
+    return 0;
+}
+
+/* Each level uses the best kernel it has for every layer
+ */
+int setSimd(const int l)
+{
+    if (l < 0 || l >= SIMD_LEVELS || !simdSupported(l))
+        return 0;
+
+    Kernels k = {ftUpdateScalar, clipAccScalar, clipHiddenScalar, affineScalar, affineSparseScalar};
+
+    #ifdef SIMD_X86
+    assert(kHalfDimensionFT % SSE2_TILE == 0 && kHalfDimensionFT % AVX2_TILE == 0);
+
+    if (l >= SIMD_SSE2)
+        k = (Kernels) {ftUpdateSse2, clipAccSse2, clipHiddenSse2, affineScalar, affineSparseScalar};
+    if (l >= SIMD_SSSE3)
+    {
+        k.affine = affineSsse3;
+        k.affineSparse = affineSparseSsse3;
+    }
+    if (l >= SIMD_AVX2)
+        k = (Kernels) {ftUpdateAvx2, clipAccAvx2, clipHiddenAvx2, affineAvx2, affineSparseAvx2};
+    if (l >= SIMD_VNNI)
+    {
+        const int avx512 = __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl");
+        k.affine = avx512? affineAvx512Vnni : affineAvxVnni;
+        k.affineSparse = avx512? affineSparseAvx512Vnni : affineSparseAvxVnni;
+    }
+    #endif
+
+    level = l;
+    kernels = k;
+    return 1;
+}
+
+void initSimd(void)
+{
+    for (int mask = 0; mask < 256; ++mask)
+    {
+        int n = 0;
+        for (int bit = 0; bit < 8; ++bit)
+            if (mask & (1 << bit))
+                nnzLookup[mask][n++] = bit;
+    }
+
+    int l = SIMD_LEVELS - 1;
+    while (!setSimd(l))
+        --l;
+}
+
+int simdLevel(void)
+{
+    return level;
+}
+
+const char* simdName(const int l)
+{
+    switch (l)
+    {
+        case SIMD_VNNI: return "vnni";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSSE3: return "ssse3";
+        case SIMD_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+void ftUpdate(int16_t* out, const int16_t* in, const int16_t* const* add, const int nAdd, const int16_t* const* sub, const int nSub)
+{
+    assert(nAdd <= MAX_FT_ROWS && nSub <= MAX_FT_ROWS);
+    kernels.ftUpdate(out, in, add, nAdd, sub, nSub);
+}
+
+void clipAcc(const int16_t* in, int8_t* out, const int n)
+{
+    assert(n % 32 == 0);
+    kernels.clipAcc(in, out, n);
+}
+
+void clipHidden(const int32_t* in, int8_t* out, const int n)
+{
+    assert(n % 32 == 0);
+    kernels.clipHidden(in, out, n);
+}
+
+void affine(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    assert(inDim % 32 == 0);
+    kernels.affine(in, inDim, ws, bs, out);
+}
+
+void affineSparse(const int8_t* in, const int inDim, const int8_t* ws, const int32_t* bs, int32_t* out)
+{
+    assert(inDim % 32 == 0 && inDim <= kDimensionFT);
+    kernels.affineSparse(in, inDim, ws, bs, out);
+}
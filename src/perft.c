@@ -162,11 +162,7 @@ static NNUE dummy;
 
 void initDummy(void)
 {
-    dummy = (NNUE) {};
-    dummy.ftBiases = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT);
-    dummy.ftWeights = (int16_t*)malloc(sizeof(int16_t)*kHalfDimensionFT*kInputDimensionsFT);
-    CHECK_MALLOC(dummy.ftBiases);
-    CHECK_MALLOC(dummy.ftWeights);
+    allocNNUE(&dummy);
 
     for (int i = 0; i < kHalfDimensionFT; ++i)
     {
@@ -215,8 +211,8 @@ int nnuePerft(Board b, const int depth, int16_t* test)
         inputLayer(&dummy, &b, WHITE, nInputAft);
         inputLayer(&dummy, &b, BLACK, nInputAft + 256);
 /*
-        applyChanges(&dummy, &b, &q, WHITE, test);
-        applyChanges(&dummy, &b, &q, BLACK, test + 256);
+        applyChanges(&dummy, &b, &q, WHITE, test, test);
+        applyChanges(&dummy, &b, &q, BLACK, test + 256, test + 256);
 */
         for (int j = 0; j < 512; ++i)
         {
@@ -234,8 +230,8 @@ int nnuePerft(Board b, const int depth, int16_t* test)
         for (int j = 0; j < q.idx; ++j)
             q.changes[j].appears ^= 1;
 /*
-        applyChanges(&dummy, &b, &q, WHITE, test);
-        applyChanges(&dummy, &b, &q, BLACK, test+256);
+        applyChanges(&dummy, &b, &q, WHITE, test, test);
+        applyChanges(&dummy, &b, &q, BLACK, test+256, test+256);
 */
         for (int i = 0; i < 512; ++i)
         {
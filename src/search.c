@@ -4,8 +4,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "../include/global.h"
 #include "../include/board.h"
@@ -15,12 +18,12 @@
 #include "../include/allmoves.h"
 #include "../include/hash.h"
 #include "../include/sort.h"
+#include "../include/nnue.h"
 #include "../include/search.h"
 #include "../include/evaluation.h"
 #include "../include/mate.h"
 #include "../include/uci.h"
 #include "../include/io.h"
-#include "../include/nnue.h"
 #ifdef USE_TB
 #include "../include/gaviota.h"
 #endif
@@ -32,13 +35,15 @@ const int DEPTH_APPLY_CONSECUTIVE_MOVE_TIME_REDUCTION = 7;
 
 const int PLY_SIZE = 100;
 
-static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* list, const int numMoves, Repetition rep);
-__attribute__((hot)) static int pvSearch(Board b, int alpha, int beta, int depth, const int height, int null, const uint64_t prevHash, Repetition* rep, const int isInC);
+static Move bestMoveList(SearchThread* td, Board b, const int depth, int alpha, int beta, Move* list, const int numMoves, Repetition rep);
+static Move multiPVList(SearchThread* td, Board b, const int depth, Move* list, const int numMoves, Repetition rep, const int numPV);
+__attribute__((hot)) static int pvSearch(SearchThread* td, Board b, int alpha, int beta, int depth, const int height, int null, const uint64_t prevHash, Repetition* rep, const int isInC);
 
-static void internalIterDeepening(Board b, Move* list, const int numMoves, int alpha, const int beta, const int depth, const int height, const uint64_t prevHash, Repetition* rep);
-static int nullMove(Board b, const int depth, const int beta, const uint64_t prevHash);
+static void internalIterDeepening(SearchThread* td, Board b, Move* list, const int numMoves, int alpha, const int beta, const int depth, const int height, const uint64_t prevHash, Repetition* rep);
+static int nullMove(SearchThread* td, Board b, const int depth, const int beta, const uint64_t prevHash);
 static inline int isDraw(const Board* b, const Repetition* rep, const uint64_t newHash, const int lastMCapture);
-static int evaluate(const Board* b);
+static int evaluate(SearchThread* td, const Board* b, const uint64_t hash);
+static int lazyEvaluate(SearchThread* td, const Board* b, const uint64_t hash, const int alpha, const int beta);
 
 #ifdef USE_TB
 static Move tableLookUp(Board b, int* tbAv);
@@ -73,18 +78,27 @@ inline static const int plyToDepth(const int ply)
 
 static Move NO_MOVE = (Move) {.from = -1, .to = -1};
 
-/* Time management */
-static clock_t stopAt = 0;
-static clock_t timeToMove = 0;
+/* The TT doesn't keep the captured piece, it is read from the board
+ */
+static inline int isValidTTMove(const Board* b, Move* m)
+{
+    for (int p = QUEEN; p <= PAWN; ++p)
+        if (b->piece[1^b->stm][p] & POW2[m->to])
+            m->capture = p;
+    return moveIsValidBasic(b, m);
+}
+
+/* Time management, stopAt, timeToMove and finishingTime are shared with the timer thread */
+static _Atomic clock_t stopAt = 0;
+static _Atomic clock_t timeToMove = 0;
+static _Atomic clock_t timerStart = 0; //Either the start of the search or the ponderhit
 static int playWithTime = 0;
-static int foundBeforeTimesUp = 0;
-static int finishingTime = 0;
+static atomic_int pondering = 0;
+static int ponderHitPending = 0; //A ponderhit that arrived before the search started pondering
+static atomic_int finishingTime = 0;
 static int requestedExtraTime = 0;
 static int consecutiveMoveTimeReductions = 0;
 
-/* Info string */
-static uint64_t nodes = 0;
-
 /* Debug info */
 static uint64_t noMoveGen = 0;
 static uint64_t repe = 0;
@@ -95,10 +109,69 @@ static uint64_t betaCutOff = 0;
 static uint64_t betaCutOffHit = 0;
 static uint64_t queries = 0;
 
-static int exitFlag = 0;
+/* Threads, threads[0] is the main thread and is run by the caller of bestTime
+ * the helpers search the same root (Lazy SMP) and only share the TT
+ */
+static SearchThread* threads = NULL;
+static int numThreads = 0;
+
+static atomic_int exitFlag = 0;
+
+/* The timer sleeps until stopAt and raises exitFlag, so the search never polls the clock
+ * while pondering it sleeps until the ponderhit
+ */
+static pthread_mutex_t timerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timerCond;
+static pthread_once_t timerCondOnce = PTHREAD_ONCE_INIT;
+
+/* The cond waits on CLOCK_MONOTONIC (getTime), it is created once and never destroyed
+ * since stop and ponderhit can signal it at any moment
+ */
+static void initTimerCond(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timerCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
 
 static int useNNUEEval = 0;
 
+/* The qsearch positions whose material + PST estimate is further than this from the window
+ * are evaluated with the estimate instead of the NNUE, 0 disables it */
+static int lazyMargin = DEFAULT_LAZY_MARGIN;
+
+/* Searches whose root has at most this many pieces use the classical evaluation unless there is an endgame network,
+ * 0 always uses the NNUE */
+static int classicalPieces = DEFAULT_CLASSICAL_PIECES;
+
+#ifdef USE_NNUE
+/* nnueGeneration when the eval cache was filled */
+static unsigned cacheGeneration = 0;
+static int cacheNNUE = 1;
+#endif
+
+/* Number of root moves reported with an exact score, only the main thread searches them */
+static int multiPV = 1;
+static PV multiPVLines[NMOVES];
+
+static void initThread(SearchThread* td)
+{
+    td->nodes = 0;
+    td->nnueEvals = 0;
+    td->lazyEvals = 0;
+    td->evalHits = 0;
+    td->evalMisses = 0;
+    td->percentage = 0;
+    td->foundBeforeTimesUp = -1;
+    td->completedDepth = 0;
+    td->best = NO_MOVE;
+    td->bestPV.length = 0;
+
+    initHistory(&td->hs);
+    initKM(&td->hs);
+}
 
 void initCall(void)
 {
@@ -110,24 +183,230 @@ void initCall(void)
     researches = 0;
     repe = 0;
     noMoveGen = 0;
-    exitFlag = 0;
-    nodes = 0;
     finishingTime = 0;
     requestedExtraTime = 0;
-    foundBeforeTimesUp = 0;
     consecutiveMoveTimeReductions = 0;
     useNNUEEval = 1;
+    newSearchTT();
 
-    initHistory();
-    initKM();
+    if (!threads)
+        setThreads(1);
+    for (int i = 0; i < numThreads; ++i)
+        initThread(&threads[i]);
     //reinitializeTable();
 }
 
+/* Sets the number of threads used in the search, including the main one
+ */
+void setThreads(const int n)
+{
+    free(threads);
+    numThreads = min(max(n, 1), MAX_THREADS);
+    threads = malloc(numThreads * sizeof(SearchThread));
+    CHECK_MALLOC(threads);
+
+    for (int i = 0; i < numThreads; ++i)
+        threads[i].id = i;
+}
+
+/* Aborts the current search (stop = 1), the search returns the best move found so far.
+ * Has to be cleared (stop = 0) before launching a search from another thread
+ */
+void setStop(const int stop)
+{
+    pthread_once(&timerCondOnce, initTimerCond);
+    pthread_mutex_lock(&timerMutex);
+    atomic_store(&exitFlag, stop);
+    if (stop)
+        pthread_cond_broadcast(&timerCond);
+    else
+        ponderHitPending = 0;
+    pthread_mutex_unlock(&timerMutex);
+}
+
+/* The opponent played the expected move, the ponder search goes on as a normal timed search
+ * the iterations already completed are kept, the time starts counting now.
+ * If the search thread hasn't started yet it will search with time from the beginning
+ */
+void ponderHit(void)
+{
+    pthread_once(&timerCondOnce, initTimerCond);
+    pthread_mutex_lock(&timerMutex);
+    if (pondering)
+    {
+        timerStart = getTime();
+        stopAt = timerStart + timeToMove;
+        atomic_store(&pondering, 0);
+        pthread_cond_broadcast(&timerCond);
+    }
+    else
+        ponderHitPending = 1;
+    pthread_mutex_unlock(&timerMutex);
+}
+
+/* Expected reply to best, the second move of the PV of the last search, from = -1 if there is none
+ */
+Move ponderMove(const Move best)
+{
+    const PV* pv = &threads[0].bestPV;
+    if (pv->length < 2 || !compMoves(&pv->moves[0], &best))
+        return NO_MOVE;
+
+    return pv->moves[1];
+}
+
+/* The line of the node is m followed by the line of the child
+ */
+static inline void updatePV(PV* pv, const Move m, const PV* child)
+{
+    pv->moves[0] = m;
+    memcpy(pv->moves + 1, child->moves, child->length * sizeof(Move));
+    pv->length = child->length + 1;
+}
+
+/* Waits until stopAt, if most of the root moves have been searched it gives some extra time
+ * stopAt can be increased by the main thread meanwhile, so it is reread every time the timer wakes up
+ */
+static void* timer(void* _args)
+{
+    (void)_args;
+    struct timespec ts;
+    clock_t now, until;
+
+    pthread_mutex_lock(&timerMutex);
+    while (!exitFlag)
+    {
+        if (pondering)
+        {
+            pthread_cond_wait(&timerCond, &timerMutex);
+            continue;
+        }
+
+        now = getTime();
+        until = stopAt;
+        if (now >= until)
+        {
+            if (threads[0].percentage > .70f && !finishingTime)
+            {
+                finishingTime = 1;
+                stopAt += timeToMove / 5;
+                continue;
+            }
+            atomic_store(&exitFlag, 1);
+            break;
+        }
+
+        ts.tv_sec = until / CLOCKS_PER_SEC;
+        ts.tv_nsec = (until % CLOCKS_PER_SEC) * (1000000000 / CLOCKS_PER_SEC);
+        pthread_cond_timedwait(&timerCond, &timerMutex, &ts);
+    }
+    pthread_mutex_unlock(&timerMutex);
+
+    return NULL;
+}
+
+void setLazyMargin(const int margin)
+{
+    lazyMargin = max(margin, 0);
+}
+
+void setClassicalPieces(const int n)
+{
+    classicalPieces = min(max(n, 0), 32);
+}
+
+void setMultiPV(const int n)
+{
+    multiPV = min(max(n, 1), NMOVES);
+}
+
+int getThreads(void)
+{
+    return max(numThreads, 1);
+}
+
+uint64_t totalNodes(void)
+{
+    uint64_t tot = 0;
+    for (int i = 0; i < numThreads; ++i)
+        tot += threads[i].nodes;
+    return tot;
+}
+
+/* Data that the helpers need to start searching */
+typedef struct
+{
+    SearchThread* td;
+    Board b;
+    Repetition rep;
+    Move list[NMOVES];
+    int numMoves;
+    int depth;
+} HelperArgs;
+
+/* Iterative deepening for the helper threads, no time management nor output
+ * half of the helpers start one ply deeper so that not all of them search the same depths
+ */
+static void* helperSearch(void* _args)
+{
+    HelperArgs* args = _args;
+    SearchThread* td = args->td;
+    Move* list = args->list;
+    const int numMoves = args->numMoves;
+
+    Move temp;
+    int bestScore = 0, delta, alpha, beta;
+
+    for (int depth = 1 + (td->id & 1); depth <= args->depth; ++depth)
+    {
+        delta = 45;
+        alpha = MINS_INF;
+        beta = PLUS_INF;
+        if (depth >= 6)
+        {
+            alpha = bestScore - delta;
+            beta = bestScore + delta;
+        }
+
+        sort(list, list+numMoves);
+        while (1)
+        {
+            temp = bestMoveList(td, args->b, plyToDepth(depth), alpha, beta, list, numMoves, args->rep);
+
+            if (exitFlag)
+                return NULL;
+
+            if (temp.score >= beta)
+            {
+                delta += delta / 2;
+                beta += delta;
+            }
+            else if (temp.score <= alpha)
+            {
+                beta = (beta + alpha) / 2;
+                alpha -= delta;
+                delta += delta / 2;
+            }
+            else
+                break;
+        }
+
+        td->best = temp;
+        td->bestPV = td->pv[0];
+        td->completedDepth = depth;
+        bestScore = temp.score;
+    }
+
+    return NULL;
+}
+
 static int us;
 Move bestTime(Board b, Repetition rep, SearchParams sp)
 {
     initCall();
 
+    SearchThread* td = &threads[0];
+
     SearchData sd = (SearchData) {.lastMove = NO_MOVE, .lastScore = 0, .consecutiveMove = 0, .consecutiveScore = 0};
     assert(sp.timeToMove >= 0);
     assert(sp.extraTime >= 0);
@@ -143,10 +422,15 @@ Move bestTime(Board b, Repetition rep, SearchParams sp)
         sp.depth = MAX_PLY;
     }
 
-    clock_t start = clock(), now, elapsed;
+    clock_t start = getTime(), now, elapsed;
 
+    pthread_mutex_lock(&timerMutex);
+    timerStart = start;
     stopAt = sp.timeToMove + start;
     timeToMove = sp.timeToMove;
+    pondering = sp.ponder && !ponderHitPending;
+    ponderHitPending = 0;
+    pthread_mutex_unlock(&timerMutex);
 
     us = b.stm;
 
@@ -154,41 +438,75 @@ Move bestTime(Board b, Repetition rep, SearchParams sp)
     const int numMoves = legalMoves(&b, list) >> 1;
 
     //If there is only one possible move, return it
-    if (playWithTime && numMoves == 1)
+    if (playWithTime && !pondering && numMoves == 1)
         return list[0];
 
     #ifdef USE_TB
     //If there is little time, caching can give problems
-    if (canGav(b.allPieces))
+    if (!sp.infinite && canGav(b.allPieces))
     {
         int tbAv;
         Move tb = tableLookUp(b, &tbAv);
         if (tbAv)
         {
-            infoString(tb, 0, 0, 1000 * (clock() - start) / CLOCKS_PER_SEC);
+            infoString(&(PV) {.moves = {tb}, .length = 1}, tb.score, 0, 0, 1000 * (getTime() - start) / CLOCKS_PER_SEC, 0);
             return tb;
         }
     }
     #endif
 
-    //Determine if we use the classical evaluation
-    //If there are too few pieces, classical evaluation is much better
-    //Due to it being much faster (and endgames with king moves are extremely slow with NNUEs)
-    //I have tried changes within the evaluation but the NNUE and the evaluation are too far appart.
-    //The best method is to simply turn it on / off at the global level
-    int ourPieces = POPCOUNT(b.color[b.stm]);
-    int oppPieces = POPCOUNT(b.color[1^b.stm]);
-    useNNUEEval = ourPieces + oppPieces > 8;
+    assignScores(&td->hs, &b, list, numMoves, NO_MOVE, 0);
+
+    //Every thread keeps the network loaded now until the search ends, even if another one is loaded
     #ifdef USE_NNUE
-    if (!useNNUEEval)
+    const unsigned nets = nnueGeneration();
+    #endif
+    for (int i = 0; i < numThreads; ++i)
+        attachNNUE(&threads[i].accStack);
+
+    #ifdef USE_NNUE
+    /* Without an endgame network the classical evaluation is used in endgames, it is much faster there.
+     * The switch is global, the NNUE and the classical scores are too far apart to mix them in a search
+     */
+    useNNUEEval = threads[0].accStack.nn[NNUE_ENDGAME] || !classicalPieces || POPCOUNT(b.allPieces) > classicalPieces;
+
+    //The cached evaluations are from other networks or from the other evaluation
+    if (nets != cacheGeneration || useNNUEEval != cacheNNUE)
     {
-        printf("debug Switching off the NNUE because there are too few pieces %d\n", ourPieces + oppPieces);
+        clearEvalCache();
+        cacheGeneration = nets;
+        cacheNNUE = useNNUEEval;
     }
     #endif
 
-    assignScores(&b, list, numMoves, NO_MOVE, 0);
+    pthread_once(&timerCondOnce, initTimerCond);
+
+    pthread_t timerId;
+    if (playWithTime)
+        pthread_create(&timerId, NULL, timer, NULL);
+
+    //Launch the helpers, each one with its own copy of the root
+    pthread_t helperIds[MAX_THREADS];
+    HelperArgs* helperArgs = NULL;
+    if (numThreads > 1)
+    {
+        helperArgs = malloc((numThreads - 1) * sizeof(HelperArgs));
+        CHECK_MALLOC(helperArgs);
+    }
+    for (int i = 1; i < numThreads; ++i)
+    {
+        HelperArgs* args = &helperArgs[i-1];
+        args->td = &threads[i];
+        args->b = b;
+        args->rep = rep;
+        args->numMoves = numMoves;
+        args->depth = sp.depth;
+        memcpy(args->list, list, numMoves * sizeof(Move));
+        pthread_create(&helperIds[i], NULL, helperSearch, args);
+    }
 
     Move best = list[0], temp;
+    const int numPV = min(multiPV, numMoves);
     int bestScore = 0;
     int delta;
     int alpha = MINS_INF, beta = PLUS_INF;
@@ -202,62 +520,78 @@ Move bestTime(Board b, Repetition rep, SearchParams sp)
             beta = bestScore + delta;
         }
 
-        sort(list, list+numMoves);
-        while (1)
+        if (numPV > 1)
         {
-            foundBeforeTimesUp = -1;
-            temp = bestMoveList(b, plyToDepth(depth), alpha, beta, list, numMoves, rep);
+            //Each line has its own aspiration window, the scores of the top moves are always exact
+            if (depth == 1)
+                sort(list, list+numMoves);
+            temp = multiPVList(td, b, plyToDepth(depth), list, numMoves, rep, numPV);
 
-            now = clock();
+            now = getTime();
             elapsed = now - start;
-
-            if (temp.score >= beta)
+        }
+        else
+        {
+            sort(list, list+numMoves);
+            while (1)
             {
-                delta += delta / 2;
-                beta += delta;
-                researches++;
+                td->foundBeforeTimesUp = -1;
+                temp = bestMoveList(td, b, plyToDepth(depth), alpha, beta, list, numMoves, rep);
 
-                if (requestedExtraTime == 0 && now < stopAt && depth > 5)
+                now = getTime();
+                elapsed = now - start;
+
+                if (temp.score >= beta)
                 {
-                    requestedExtraTime++;
-                    stopAt += sp.extraTime;
-                    timeToMove += sp.extraTime;
+                    delta += delta / 2;
+                    beta += delta;
+                    researches++;
+
+                    if (requestedExtraTime == 0 && !pondering && now < stopAt && depth > 5)
+                    {
+                        requestedExtraTime++;
+                        stopAt += sp.extraTime;
+                        timeToMove += sp.extraTime;
+                    }
+                    else if (requestedExtraTime == 1 && !pondering && now < stopAt && depth > 8)
+                    {
+                        requestedExtraTime++;
+                        stopAt += sp.extraTime;
+                        timeToMove += sp.extraTime;
+                    }
                 }
-                else if (requestedExtraTime == 1 && now < stopAt && depth > 8)
+                else if (temp.score <= alpha)
                 {
-                    requestedExtraTime++;
-                    stopAt += sp.extraTime;
-                    timeToMove += sp.extraTime;
-                }
-            }
-            else if (temp.score <= alpha)
-            {
-                beta = (beta + alpha) / 2;
-                alpha -= delta;
-                delta += delta / 2;
-                researches++;
+                    beta = (beta + alpha) / 2;
+                    alpha -= delta;
+                    delta += delta / 2;
+                    researches++;
 
-                if (requestedExtraTime == 0 && now < stopAt && depth > 5)
-                {
-                    requestedExtraTime++;
-                    stopAt += 2*sp.extraTime;
-                    timeToMove += 2*sp.extraTime;
+                    if (requestedExtraTime == 0 && !pondering && now < stopAt && depth > 5)
+                    {
+                        requestedExtraTime++;
+                        stopAt += 2*sp.extraTime;
+                        timeToMove += 2*sp.extraTime;
+                    }
+                    else if (requestedExtraTime == 1 && !pondering && now < stopAt && depth > 8)
+                    {
+                        requestedExtraTime++;
+                        stopAt += 2*sp.extraTime;
+                        timeToMove += 2*sp.extraTime;
+                    }
                 }
-                else if (requestedExtraTime == 1 && now < stopAt && depth > 8)
+                else
                 {
-                    requestedExtraTime++;
-                    stopAt += 2*sp.extraTime;
-                    timeToMove += 2*sp.extraTime;
+                    if (exitFlag && td->foundBeforeTimesUp > -1)
+                    {
+                        best = list[td->foundBeforeTimesUp];
+                        td->bestPV = td->pv[0];
+                    }
+                    break;
                 }
+                if (exitFlag || finishingTime)
+                    break;
             }
-            else
-            {
-                if (exitFlag && foundBeforeTimesUp > -1)
-                    best = list[foundBeforeTimesUp];
-                break;
-            }
-            if (exitFlag || finishingTime)
-                break;
         }
         if (exitFlag)
             break;
@@ -266,8 +600,15 @@ Move bestTime(Board b, Repetition rep, SearchParams sp)
         sd.lastScore = best.score;
         best = temp;
         bestScore = best.score;
+        td->best = best;
+        td->bestPV = (numPV > 1)? multiPVLines[0] : td->pv[0];
+        td->completedDepth = depth;
 
-        infoString(best, depth, nodes, 1000 * elapsed / CLOCKS_PER_SEC);
+        if (numPV > 1)
+            for (int i = 0; i < numPV; ++i)
+                infoString(&multiPVLines[i], list[i].score, depth, totalNodes(), 1000 * elapsed / CLOCKS_PER_SEC, i + 1);
+        else
+            infoString(&td->bestPV, best.score, depth, totalNodes(), 1000 * elapsed / CLOCKS_PER_SEC, 0);
 
         if (compMoves(&sd.lastMove, &best))
             sd.consecutiveMove++;
@@ -301,13 +642,57 @@ Move bestTime(Board b, Repetition rep, SearchParams sp)
         timeToMove = min(timeToMove, sp.maxTime);
 
         //A premature exit when we are playing with time
-        if (playWithTime &&
+        if (playWithTime && !pondering &&
                (best.score >= PLUS_MATE //We have found a mate
-            || (clock_t)(1.35f * elapsed) > timeToMove) //There isn't enough time for another iter
+            || (clock_t)(1.35f * (now - timerStart)) > timeToMove) //There isn't enough time for another iter
             || finishingTime) //We have consumed the extra time
             break;
     }
 
+    //The bestmove can't be sent while pondering or in an infinite search, wait for the ponderhit or the stop
+    pthread_mutex_lock(&timerMutex);
+    while ((pondering || sp.infinite) && !exitFlag)
+        pthread_cond_wait(&timerCond, &timerMutex);
+    pthread_mutex_unlock(&timerMutex);
+
+    //Stop the helpers and the timer, if a helper has completed a deeper iteration use its move
+    setStop(1);
+    if (playWithTime)
+        pthread_join(timerId, NULL);
+    pondering = 0;
+    for (int i = 1; i < numThreads; ++i)
+    {
+        pthread_join(helperIds[i], NULL);
+        if (threads[i].completedDepth > td->completedDepth)
+        {
+            td->completedDepth = threads[i].completedDepth;
+            best = threads[i].best;
+            td->bestPV = threads[i].bestPV;
+        }
+    }
+    free(helperArgs);
+    atomic_store(&exitFlag, 0);
+
+    uint64_t nnueEvals = 0, lazyEvals = 0, evalHits = 0, evalMisses = 0;
+    for (int i = 0; i < numThreads; ++i)
+    {
+        nnueEvals += threads[i].nnueEvals;
+        lazyEvals += threads[i].lazyEvals;
+        evalHits += threads[i].evalHits;
+        evalMisses += threads[i].evalMisses;
+    }
+    if (evalHits + evalMisses)
+        printf("info string eval cache hits %llu of %llu (%.1f%%)\n", (unsigned long long)evalHits,
+            (unsigned long long)(evalHits + evalMisses), 100.0 * evalHits / (evalHits + evalMisses));
+    #ifdef USE_NNUE
+    if (lazyMargin && nnueEvals + lazyEvals)
+        printf("info string lazy eval skipped %llu of %llu NNUE evaluations (%.1f%%)\n", (unsigned long long)lazyEvals,
+            (unsigned long long)(nnueEvals + lazyEvals), 100.0 * lazyEvals / (nnueEvals + lazyEvals));
+    #endif
+
+    for (int i = 0; i < numThreads; ++i)
+        detachNNUE(&threads[i].accStack);
+
     if (playWithTime && consecutiveMoveTimeReductions > 0)
         printf("Reduced time %d times\n", consecutiveMoveTimeReductions);
 
@@ -324,13 +709,9 @@ Move bestTime(Board b, Repetition rep, SearchParams sp)
     return best;
 }
 
-static double percentage = 0;
-static Move moveStack[MAX_PLY+10]; //To avoid possible overflow errors
-static int evalStack[MAX_PLY+10];
-
-static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* list, const int numMoves, Repetition rep)
+static Move bestMoveList(SearchThread* td, Board b, const int depth, int alpha, int beta, Move* list, const int numMoves, Repetition rep)
 {
-    foundBeforeTimesUp = -1;
+    td->foundBeforeTimesUp = -1;
     assert(depthToPly(depth) > 0);
     assert(numMoves > 0);
     assert(rep.index >= 0 && rep.index < 128);
@@ -341,27 +722,29 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
     uint64_t hash = hashPosition(&b), newHash;
     int subtreeSize[NMOVES];
 
-    initNNUEAcc(&b);
-    evalStack[0] = evaluate(&b);
+    initNNUEAcc(&b, &td->accStack);
+    td->evalStack[0] = evaluate(td, &b, hash);
 
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
 
     int undo;
     for (int i = 0; i < numMoves; ++i)
     {
         undo = 0;
-        long initNodes = nodes;
+        long initNodes = td->nodes;
         //If the move leads to being mated, break (since the moves are ordered based on score)
         if (list[i].score < MINS_MATE)
             break;
-        moveStack[0] = list[i];
+        td->moveStack[0] = list[i];
+        td->pv[1].length = 0;
 
-        percentage = i / (double) numMoves;
-        assert(percentage >= 0 && percentage <= 1.1);
+        td->percentage = i / (double) numMoves;
+        assert(td->percentage >= 0 && td->percentage <= 1.1);
 
         makeMove(&b, list[i], &h);
 
         newHash = makeMoveHash(hash, &b, list[i], h);
+
+        prefetchTT(newHash);
         inC = isInCheck(&b, b.stm);
 
         if (insuffMat(&b) || isThreeRep(&rep, newHash))
@@ -370,34 +753,35 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
         }
         else
         {
-            if (useNNUEEval) updateDo(&q, list[i], &b);
+            if (useNNUEEval) updateDo(&td->accStack, list[i], &b);
             undo = 1;
             addHash(&rep, newHash);
             if (i == 0)
             {
-                val = -pvSearch(b, -beta, -alpha, depth - plyToDepth(1), 1, 0, newHash, &rep, inC);
+                val = -pvSearch(td, b, -beta, -alpha, depth - plyToDepth(1), 1, 0, newHash, &rep, inC);
             }
             else
             {
-                val = -pvSearch(b, -alpha - 1, -alpha, depth - plyToDepth(1), 1, 0, newHash, &rep, inC);
+                val = -pvSearch(td, b, -alpha - 1, -alpha, depth - plyToDepth(1), 1, 0, newHash, &rep, inC);
                 if (val > alpha)
-                    val = -pvSearch(b, -beta, -alpha, depth - plyToDepth(1), 1, 0, newHash, &rep, inC);
+                    val = -pvSearch(td, b, -beta, -alpha, depth - plyToDepth(1), 1, 0, newHash, &rep, inC);
             }
             remHash(&rep);
         }
 
         undoMove(&b, list[i], &h);
 
-        if (undo && useNNUEEval) updateUndo(&q, &b);
+        if (undo && useNNUEEval) updateUndo(&td->accStack);
 
         //For the sorting at later depths
         list[i].score = val;
-        subtreeSize[i] = (int)((nodes - initNodes) / 2);
+        subtreeSize[i] = (int)((td->nodes - initNodes) / 2);
 
         if (val > alpha && !exitFlag)
         {
-            foundBeforeTimesUp = i;
+            td->foundBeforeTimesUp = i;
             currBest = list[i];
+            updatePV(&td->pv[0], list[i], &td->pv[1]);
             alpha = val;
             if (val >= beta)
             {
@@ -410,8 +794,142 @@ static Move bestMoveList(Board b, const int depth, int alpha, int beta, Move* li
     return currBest;
 }
 
+/* Searches a single root move with the window [alpha, beta]
+ */
+static int searchRootMove(SearchThread* td, const Board* b, const Move m, const uint64_t hash, const int alpha, const int beta, const int depth, Repetition* rep)
+{
+    Board child = *b;
+    History h;
+    int val;
+
+    td->moveStack[0] = m;
+    td->pv[1].length = 0;
+    makeMove(&child, m, &h);
+    const uint64_t newHash = makeMoveHash(hash, &child, m, h);
+    prefetchTT(newHash);
+
+    if (insuffMat(&child) || isThreeRep(rep, newHash))
+        return 0;
+
+    if (useNNUEEval) updateDo(&td->accStack, m, &child);
+    addHash(rep, newHash);
+    val = -pvSearch(td, child, -beta, -alpha, depth - plyToDepth(1), 1, 0, newHash, rep, isInCheck(&child, child.stm));
+    remHash(rep);
+    if (useNNUEEval) updateUndo(&td->accStack);
+
+    return val;
+}
+
+/* The lines are only swapped when needed (lines != NULL), they are big
+ */
+static inline void swapRootMoves(Move* list, int* subtreeSize, PV* lines, const int i, const int j)
+{
+    const Move m = list[i];
+    const int size = subtreeSize[i];
+    list[i] = list[j];
+    list[j] = m;
+    subtreeSize[i] = subtreeSize[j];
+    subtreeSize[j] = size;
+
+    if (lines)
+    {
+        const PV pv = lines[i];
+        lines[i] = lines[j];
+        lines[j] = pv;
+    }
+}
+
+/* Root search for MultiPV, a single pass over the moves which keeps the first numPV of the list
+ * sorted with exact scores. Each of them is searched with its own aspiration window around
+ * its last score, the rest only have to prove that they are worse than the last of the top moves.
+ * The moves which don't make it to the top are ordered by the size of their subtree for the next iteration
+ */
+static Move multiPVList(SearchThread* td, Board b, const int depth, Move* list, const int numMoves, Repetition rep, const int numPV)
+{
+    assert(depthToPly(depth) > 0);
+    assert(numPV > 1 && numPV <= numMoves);
+    assert(rep.index >= 0 && rep.index < 128);
+
+    const int aspiration = depthToPly(depth) >= 6;
+    const uint64_t hash = hashPosition(&b);
+    int subtreeSize[NMOVES];
+    int val, alpha, beta, delta, worst, j;
+    uint64_t initNodes;
+
+    initNNUEAcc(&b, &td->accStack);
+    td->evalStack[0] = evaluate(td, &b, hash);
+
+    for (int i = 0; i < numMoves; ++i)
+    {
+        initNodes = td->nodes;
+        td->percentage = i / (double) numMoves;
+
+        if (i < numPV)
+        {
+            delta = 45;
+            alpha = aspiration? list[i].score - delta : MINS_INF;
+            beta = aspiration? list[i].score + delta : PLUS_INF;
+            while (1)
+            {
+                val = searchRootMove(td, &b, list[i], hash, alpha, beta, depth, &rep);
+                if (exitFlag)
+                    return list[0];
+
+                if (val >= beta)
+                {
+                    delta += delta / 2;
+                    beta += delta;
+                    researches++;
+                }
+                else if (val <= alpha)
+                {
+                    beta = (beta + alpha) / 2;
+                    alpha -= delta;
+                    delta += delta / 2;
+                    researches++;
+                }
+                else
+                    break;
+            }
+        }
+        else
+        {
+            worst = list[numPV - 1].score;
+            val = searchRootMove(td, &b, list[i], hash, worst, worst + 1, depth, &rep);
+            if (val > worst && !exitFlag)
+                val = searchRootMove(td, &b, list[i], hash, worst, PLUS_INF, depth, &rep);
+            if (exitFlag)
+                return list[0];
+        }
+
+        list[i].score = val;
+        subtreeSize[i] = (int)((td->nodes - initNodes) / 2);
+
+        //Insert the move in the top moves, pushing the last one out if necessary
+        j = 0;
+        if (i < numPV)
+        {
+            updatePV(&multiPVLines[i], list[i], &td->pv[1]);
+            j = i;
+        }
+        else if (val > list[numPV - 1].score)
+        {
+            updatePV(&multiPVLines[i], list[i], &td->pv[1]);
+            swapRootMoves(list, subtreeSize, multiPVLines, i, numPV - 1);
+            j = numPV - 1;
+        }
+        for (; j > 0 && list[j].score > list[j - 1].score; --j)
+            swapRootMoves(list, subtreeSize, multiPVLines, j, j - 1);
+    }
+
+    for (int i = numPV + 1; i < numMoves; ++i)
+        for (j = i; j > numPV && subtreeSize[j] > subtreeSize[j - 1]; --j)
+            swapRootMoves(list, subtreeSize, NULL, j, j - 1);
+
+    return list[0];
+}
 static const int marginDepth[4] = {0, 400, 600, 1200};
-static int pvSearch(Board b, int alpha, int beta, int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC)
+static int pvSearch(SearchThread* td, Board b, int alpha, int beta, int depth, const int height, const int null, const uint64_t prevHash, Repetition* rep, const int isInC)
 {
     assert(depth % PLY_SIZE == 0);
     assert(rep->index >= 0 && rep->index < 128);
@@ -423,10 +941,9 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     if (exitFlag)
         return 0;
 
-    nodes++;
+    td->nodes++;
+    td->pv[height].length = 0;
     const int pv = beta - alpha > 1;
-    const int index = prevHash % NUM_ENTRIES;
-    assert(index >= 0 && index < NUM_ENTRIES);
 
     #ifdef USE_TB
     if (canGav(b.allPieces))
@@ -443,20 +960,6 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     }
     #endif
 
-    if (playWithTime && (nodes & 1023) == 0 && clock() > stopAt)
-    {
-        if (percentage > .70f && !finishingTime)
-        {
-            finishingTime = 1;
-            stopAt += timeToMove / 5;
-        }
-        else
-        {
-            exitFlag = 1;
-            return 0;
-        }
-    }
-
     //Mate distance pruning
     const int origAlpha = alpha;
     alpha = max(-mate(height), alpha);
@@ -465,52 +968,52 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         return alpha;
 
     if (height >= MAX_PLY)
-        return evaluate(&b);
+        return evaluate(td, &b, prevHash);
 
-    if (isInC && (depth < plyToDepth(5) || IS_CAP(moveStack[height-1])))
+    if (isInC && (depth < plyToDepth(5) || IS_CAP(td->moveStack[height-1])))
         depth += plyToDepth(1);
     else if (depth == 0)
-        return qsearch(b, alpha, beta, plyToDepth(-1));
+        return qsearch(td, b, alpha, beta, plyToDepth(-1), prevHash);
 
     const int currentRealDepth = depthToPly(depth);
     assert(plyToDepth(currentRealDepth) == depth);
 
     int val, ttHit = 0, ev = MINS_INF;
     Move bestM = NO_MOVE;
-    Eval* tableEntry = &table[index];
+    Eval tableEntry;
 
-    if (tableEntry->key == prevHash)
+    if (probeTT(prevHash, &tableEntry))
     {
-        assert(hashPosition(&b) == tableEntry->key);
-        if (height > 3 && tableEntry->depth >= currentRealDepth && abs(tableEntry->val) < PLUS_MATE - 200)
+        assert(hashPosition(&b) == tableEntry.key);
+        if (height > 3 && tableEntry.depth >= currentRealDepth && abs(tableEntry.val) < PLUS_MATE - 200)
         {
-            switch (tableEntry->flag)
+            switch (tableEntry.flag)
             {
                 case LO:
-                    alpha = max(alpha, tableEntry->val);
+                    alpha = max(alpha, tableEntry.val);
                     break;
                 case HI:
-                    beta = min(beta, tableEntry->val);
+                    beta = min(beta, tableEntry.val);
                     break;
                 case EXACT:
-                    val = tableEntry->val;
+                    val = tableEntry.val;
                     if (val < PLUS_MATE - 100)
                         return val;
             }
             if (alpha >= beta)
-                return tableEntry->val;
+                return tableEntry.val;
         }
 
-        bestM = tableEntry->m;
+        bestM = tableEntry.m;
         if (!isInC) //TODO: See if this is needed
-            ev = tableEntry->eval;
+            ev = tableEntry.eval;
         assert(bestM.from != -1);
-        ttHit = moveIsValidBasic(&b, &bestM);
+        ttHit = isValidTTMove(&b, &bestM);
     }
 
     if (!(isInC || ttHit))
-        ev = evaluate(&b);
-    evalStack[height] = ev;
+        ev = evaluate(td, &b, prevHash);
+    td->evalStack[height] = ev;
 
     assert((ev < PLUS_MATE && ev > MINS_MATE) || ev == MINS_INF);
 
@@ -523,7 +1026,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         //Razoring
         if (depth == plyToDepth(1) && ev + V_ROOK[0] <= alpha)
         {
-            const int razScore = qsearch(b, alpha, beta, plyToDepth(-1));
+            const int razScore = qsearch(td, b, alpha, beta, plyToDepth(-1), prevHash);
             if (razScore >= beta)
                 return razScore;
         }
@@ -535,7 +1038,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         //Null move
         if (!null && ev >= beta && depth > plyToDepth(R) && !zugz(b))
         {
-            if (nullMove(b, depth, beta, prevHash))
+            if (nullMove(td, b, depth, beta, prevHash))
             {
                 #ifdef DEBUG
                 ++nullCutOffs;
@@ -555,14 +1058,13 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     const int newHeight = height + 1;
     History h;
 
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
     int undo = 0;
     int inC;
 /*
     if (ttHit == 1)
     {
         assert(RANGE_64(bestM.from) && RANGE_64(bestM.to));
-        moveStack[height] = bestM;
+        td->moveStack[height] = bestM;
         makeMove(&b, bestM, &h);
         newHash = makeMoveHash(prevHash, &b, bestM, h);
 
@@ -575,14 +1077,14 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         }
         else
         {
-            if (useNNUEEval) updateDo(&q, bestM, &b);
+            if (useNNUEEval) updateDo(&td->accStack, bestM, &b);
             undo = 1;
             addHash(rep, newHash);
-            val = -pvSearch(b, -beta, -alpha, depth - 1, newHeight, null, newHash, rep, inC);
+            val = -pvSearch(td, b, -beta, -alpha, depth - 1, newHeight, null, newHash, rep, inC);
             remHash(rep);
         }
         undoMove(&b, bestM, &h);
-        if (undo && useNNUEEval) updateUndo(&q, &b);
+        if (undo && useNNUEEval) updateUndo(&td->accStack);
 
         assert(val > best);
 
@@ -598,8 +1100,8 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
                 #endif
                 if (!IS_CAP(bestM))
                 {
-                    addHistory(bestM.from, bestM.to, depth*depth, b.stm);
-                    addKM(bestM, depth);
+                    addHistory(&td->hs, bestM.from, bestM.to, depth*depth, b.stm);
+                    addKM(&td->hs, bestM, depth);
                 }
                 goto end;
             }
@@ -611,17 +1113,17 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     if (!numMoves)
         return isInC * -mate(height);
 
-    const int improving = height > 1 && ev > evalStack[height-2] + 20 && !isInC && !null;
-    const int notImproving = height > 1 && ev < evalStack[height-2] - 75 && !isInC && !null;
+    const int improving = height > 1 && ev > td->evalStack[height-2] + 20 && !isInC && !null;
+    const int notImproving = height > 1 && ev < td->evalStack[height-2] - 75 && !isInC && !null;
 
-    assignScores(&b, list, numMoves, bestM, currentRealDepth);
+    assignScores(&td->hs, &b, list, numMoves, bestM, currentRealDepth);
     sort(list, list+numMoves);
 
     int iid = 0;
     if ((iid = (depth > plyToDepth(5) && list[0].score < 290 && numMoves > 6 - pv && !ttHit)))
     {
         const int targD = pv? depth - plyToDepth(3) : plyToDepth(depthToPly(depth) / 4);
-        internalIterDeepening(b, list, numMoves, alpha, beta, targD, newHeight, prevHash, rep);
+        internalIterDeepening(td, b, list, numMoves, alpha, beta, targD, newHeight, prevHash, rep);
     }
 
     const int canBreak = depth <= plyToDepth(3) && ev + marginDepth[currentRealDepth] <= alpha && !isInC;
@@ -639,7 +1141,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
             if (!IS_CAP(m))
                 continue;
 
-            moveStack[height] = m;
+            td->moveStack[height] = m;
             assert(RANGE_64(m.from) && RANGE_64(m.to));
             if (canBreak && !IS_CAP(m) && (i > 3 + currentRealDepth || (i > 3 && !pv)))
                 break;
@@ -648,15 +1150,16 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
 
             inC = isInCheck(&b, b.stm);
             newHash = makeMoveHash(prevHash, &b, m, h);
-            if (useNNUEEval) updateDo(&q, m, &b);
+            prefetchTT(newHash);
+            if (useNNUEEval) updateDo(&td->accStack, m, &b);
             addHash(rep, newHash);
 
-            val = -pvSearch(b, -probBeta, -probBeta+1, depth - plyToDepth(4), newHeight, null, newHash, rep, inC);
+            val = -pvSearch(td, b, -probBeta, -probBeta+1, depth - plyToDepth(4), newHeight, null, newHash, rep, inC);
             undoMove(&b, m, &h);
-            if (useNNUEEval) updateUndo(&q, &b);
+            if (useNNUEEval) updateUndo(&td->accStack);
             remHash(rep);
             assert(rep->index >= 0);
-            assert(compMoves(&moveStack[height], &m) && moveStack[height].piece == m.piece);
+            assert(compMoves(&td->moveStack[height], &m) && td->moveStack[height].piece == m.piece);
 
             if (val >= probBeta)
                 return val - (probBeta - beta);
@@ -673,7 +1176,8 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
 
         int SEEscore = 0;
         m = list[i];
-        moveStack[height] = m;
+        td->moveStack[height] = m;
+        td->pv[newHeight].length = 0;
         assert(RANGE_64(m.from) && RANGE_64(m.to));
         if (canBreak && !IS_CAP(m) && (i > 3 + currentRealDepth || (i > 3 && !pv)))
             break;
@@ -691,6 +1195,7 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         }
 */
         newHash = makeMoveHash(prevHash, &b, m, h);
+        prefetchTT(newHash);
 
         if (isDraw(&b, rep, newHash, IS_CAP(m)))
         {
@@ -698,13 +1203,13 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
         }
         else
         {
-            if (useNNUEEval) updateDo(&q, m, &b);
+            if (useNNUEEval) updateDo(&td->accStack, m, &b);
             undo = 1;
 
             addHash(rep, newHash);
             if (i == 0)
             {
-                val = -pvSearch(b, -beta, -alpha, depth - plyToDepth(1), newHeight, null, newHash, rep, inC);
+                val = -pvSearch(td, b, -beta, -alpha, depth - plyToDepth(1), newHeight, null, newHash, rep, inC);
             }
             else
             {
@@ -714,19 +1219,19 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
                     reduction = 1;
                     if (i > 3 + 2*pv)
                     {
-                        int hv = history[1^b.stm][BASE_64(m.from, m.to)];
+                        int hv = td->hs.history[1^b.stm][BASE_64(m.from, m.to)];
                         reduction += 1 - (!pv && improving) + (depthToPly(depth) / 3) - (hv > 1250);
                     }
 
                     if (!pv && notImproving)
                         reduction++;
-                    else if ((IS_CAP(m) && m.capture < PAWN) || (moveStack[height-1].to == m.to && depth < plyToDepth(4)))
+                    else if ((IS_CAP(m) && m.capture < PAWN) || (td->moveStack[height-1].to == m.to && depth < plyToDepth(4)))
                         reduction--;
                     else if (m.piece == PAWN && isAdvancedPassedPawn(m, b.piece[b.stm][PAWN], 1 ^ b.stm))
                         reduction--;
                     else if (!IS_CAP(m) && m.piece == KING && !list[i].castle)
                         reduction++;
-                    else if (height > 1 && moveStack[height-2].to == m.from && moveStack[height-2].from == m.to)
+                    else if (height > 1 && td->moveStack[height-2].to == m.from && td->moveStack[height-2].from == m.to)
                         reduction++;
 
                     reduction *= PLY_SIZE;
@@ -737,20 +1242,20 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
 
                 assert(depth - reduction >= 0);
                 assert((depth - reduction) % PLY_SIZE == 0);
-                val = -pvSearch(b, -alpha-1, -alpha, depth - reduction, newHeight, null, newHash, rep, inC);
+                val = -pvSearch(td, b, -alpha-1, -alpha, depth - reduction, newHeight, null, newHash, rep, inC);
                 if (val > alpha && reduction > plyToDepth(1))
-                    val = -pvSearch(b, -alpha-1, -alpha, depth - plyToDepth(1), newHeight, null, newHash, rep, inC);
+                    val = -pvSearch(td, b, -alpha-1, -alpha, depth - plyToDepth(1), newHeight, null, newHash, rep, inC);
                 if (pv && val > alpha && val < beta)
-                    val = -pvSearch(b, -beta, -alpha, depth - plyToDepth(1), newHeight, null, newHash, rep, inC);
+                    val = -pvSearch(td, b, -beta, -alpha, depth - plyToDepth(1), newHeight, null, newHash, rep, inC);
             }
 
             remHash(rep);
             assert(rep->index >= 0);
-            assert(compMoves(&moveStack[height], &m) && moveStack[height].piece == m.piece);
+            assert(compMoves(&td->moveStack[height], &m) && td->moveStack[height].piece == m.piece);
         }
 
         undoMove(&b, m, &h);
-        if (undo && useNNUEEval) updateUndo(&q, &b);
+        if (undo && useNNUEEval) updateUndo(&td->accStack);
 
         if (val > best)
         {
@@ -759,6 +1264,8 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
             if (best > alpha)
             {
                 alpha = best;
+                if (pv)
+                    updatePV(&td->pv[height], m, &td->pv[newHeight]);
 
                 if (alpha >= beta)
                 {
@@ -769,14 +1276,14 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
 
                     if (!IS_CAP(bestM))
                     {
-                        addHistory(bestM.from, bestM.to, currentRealDepth*currentRealDepth, b.stm);
-                        addKM(bestM, currentRealDepth);
+                        addHistory(&td->hs, bestM.from, bestM.to, currentRealDepth*currentRealDepth, b.stm);
+                        addKM(&td->hs, bestM, currentRealDepth);
                     }
 
                     for (int j = 0; j < i; ++j)
                     {
                         if (!IS_CAP(list[j]))
-                            decHistory(list[j].from, list[j].to, min(currentRealDepth, 4), b.stm);
+                            decHistory(&td->hs, list[j].from, list[j].to, min(currentRealDepth, 4), b.stm);
                     }
                     break;
                 }
@@ -792,21 +1299,20 @@ static int pvSearch(Board b, int alpha, int beta, int depth, const int height, c
     else if (best >= beta)
         flag = LO;
 
-    table[index] = (Eval) {.key = prevHash, .m = bestM, .val = best, .eval = ev, .depth = currentRealDepth, .flag = flag};
+    storeTT(prevHash, bestM, best, ev, currentRealDepth, flag);
 
     return best;
 }
 
-int qsearch(Board b, int alpha, const int beta, const int depth)
+int qsearch(SearchThread* td, Board b, int alpha, const int beta, const int depth, const uint64_t hash)
 {
     assert(beta >= alpha);
+    assert(hash == hashPosition(&b));
     #ifdef DEBUG
     ++qsearchNodes;
     #endif
 
-    //int score = fastEval(&b);
-    //if (abs(score) <= V_QUEEN)
-    const int score = evaluate(&b);
+    const int score = lazyEvaluate(td, &b, hash, alpha, beta);
 
     assert(score > MINS_MATE + 200 && score < PLUS_MATE - 200);
 
@@ -831,7 +1337,6 @@ int qsearch(Board b, int alpha, const int beta, const int depth)
     int val;
 
     int undo = 0;
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
 
     for (int i = 0; i < numMoves; ++i)
     {
@@ -845,14 +1350,14 @@ int qsearch(Board b, int alpha, const int beta, const int depth)
             val = 0;
         else
         {
-            if (useNNUEEval) updateDo(&q, list[i], &b);
+            if (useNNUEEval) updateDo(&td->accStack, list[i], &b);
             undo = 1;
-            val = -qsearch(b, -beta, -alpha, depth - plyToDepth(1) /*+ (list[i].capture < 3)*/);
+            val = -qsearch(td, b, -beta, -alpha, depth - plyToDepth(1) /*+ (list[i].capture < 3)*/, makeMoveHash(hash, &b, list[i], h));
         }
 
         undoMove(&b, list[i], &h);
 
-        if (undo && useNNUEEval) updateUndo(&q, &b);
+        if (undo && useNNUEEval) updateUndo(&td->accStack);
 
         if (val > alpha)
         {
@@ -867,7 +1372,7 @@ int qsearch(Board b, int alpha, const int beta, const int depth)
 
 /* In this function there are no assumptions made about the sorting of the list
  */
-static void internalIterDeepening(Board b, Move* list, const int numMoves, int alpha, const int beta, const int depth, const int height, const uint64_t prevHash, Repetition* rep)
+static void internalIterDeepening(SearchThread* td, Board b, Move* list, const int numMoves, int alpha, const int beta, const int depth, const int height, const uint64_t prevHash, Repetition* rep)
 {
     assert(beta >= alpha);
     assert(depth >= 0);
@@ -877,7 +1382,6 @@ static void internalIterDeepening(Board b, Move* list, const int numMoves, int a
     int val;
 
     History h;
-    NNUEChangeList q = (NNUEChangeList) {.idx = 0};
 
     int undo;
     for (int i = 0; i < numMoves; ++i)
@@ -888,23 +1392,25 @@ static void internalIterDeepening(Board b, Move* list, const int numMoves, int a
 
         newHash = makeMoveHash(prevHash, &b, list[i], h);
 
+        prefetchTT(newHash);
+
         if (isDraw(&b, rep, newHash, IS_CAP(list[i])))
         {
             val = 0;
         }
         else
         {
-            if (useNNUEEval) updateDo(&q, list[i], &b);
+            if (useNNUEEval) updateDo(&td->accStack, list[i], &b);
             undo = 1;
             addHash(rep, newHash);
-            val = -pvSearch(b, -beta, -alpha, depth - plyToDepth(1), height, 1, newHash, rep, isInCheck(&b, b.stm));
+            val = -pvSearch(td, b, -beta, -alpha, depth - plyToDepth(1), height, 1, newHash, rep, isInCheck(&b, b.stm));
             remHash(rep);
         }
 
         list[i].score = val;
 
         undoMove(&b, list[i], &h);
-        if (undo && useNNUEEval) updateUndo(&q, &b);
+        if (undo && useNNUEEval) updateUndo(&td->accStack);
     }
 
     sort(list, list+numMoves);
@@ -969,13 +1475,15 @@ static Move tableLookUp(Board b, int* tbAv)
 }
 #endif
 
-static int nullMove(Board b, const int depth, const int beta, const uint64_t prevHash)
+static int nullMove(SearchThread* td, Board b, const int depth, const int beta, const uint64_t prevHash)
 {
     assert(depth > plyToDepth(R));
     Repetition _rep = (Repetition) {.index = 0};
     b.stm ^= 1;
-    const int td = (depth < plyToDepth(6))? depth - plyToDepth(R) : plyToDepth(depthToPly(depth) / 3) + plyToDepth(1);
-    const int val = -pvSearch(b, -beta, -beta + 1, td, MAX_PLY - 15, 1, changeTurn(prevHash), &_rep, 0);
+    const int nullDepth = (depth < plyToDepth(6))? depth - plyToDepth(R) : plyToDepth(depthToPly(depth) / 3) + plyToDepth(1);
+    const uint64_t nullHash = changeTurn(prevHash);
+    prefetchTT(nullHash);
+    const int val = -pvSearch(td, b, -beta, -beta + 1, nullDepth, MAX_PLY - 15, 1, nullHash, &_rep, 0);
     b.stm ^= 1;
 
     return val >= beta;
@@ -999,19 +1507,65 @@ static inline int isDraw(const Board* b, const Repetition* rep, const uint64_t n
 }
 
 static const int SEARCH_TEMPO = 11;
-static int evaluate(const Board* b)
+//The evaluation of the position without the fifty move scaling, which isn't part of the hash
+static int rawEvaluate(SearchThread* td, const Board* b)
 {
-    int ev;
     #ifdef USE_NNUE
     if (useNNUEEval)
-        ev = SEARCH_TEMPO + evaluateNNUE(b, 1);
-    else
-        ev = eval(b);
-    #else
-    ev = eval(b);
+    {
+        td->nnueEvals++;
+        return SEARCH_TEMPO + evaluateNNUE(b, &td->accStack);
+    }
     #endif
 
-    ev = ev * (100 - b->fifty) / 100;
+    return eval(b);
+}
+
+//Evaluates a position that isn't in the eval cache and stores it
+static int evaluateMiss(SearchThread* td, const Board* b, const uint64_t hash)
+{
+    td->evalMisses++;
+    const int ev = rawEvaluate(td, b);
+    storeEvalCache(hash, ev);
 
     return ev;
+}
+
+static int evaluate(SearchThread* td, const Board* b, const uint64_t hash)
+{
+    int ev;
+    if (probeEvalCache(hash, &ev))
+        td->evalHits++;
+    else
+        ev = evaluateMiss(td, b, hash);
+
+    return ev * (100 - b->fifty) / 100;
+}
+
+/* The NNUE is skipped when the material + PST estimate is so far outside [alpha, beta]
+ * that the exact evaluation wouldn't change the result of the node, a cached evaluation is used first
+ */
+static int lazyEvaluate(SearchThread* td, const Board* b, const uint64_t hash, const int alpha, const int beta)
+{
+    int ev;
+    if (probeEvalCache(hash, &ev))
+    {
+        td->evalHits++;
+        return ev * (100 - b->fifty) / 100;
+    }
+
+    #ifdef USE_NNUE
+    if (useNNUEEval && lazyMargin)
+    {
+        const int estimate = fastEval(b) * (100 - b->fifty) / 100;
+        if (estimate - lazyMargin >= beta || estimate + lazyMargin <= alpha)
+        {
+            td->lazyEvals++;
+            return estimate;
+        }
+    }
+    #endif
+
+    ev = evaluateMiss(td, b, hash);
+    return ev * (100 - b->fifty) / 100;
 }
\ No newline at end of file
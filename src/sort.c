@@ -18,16 +18,11 @@
 #include "../include/magic.h"
 #include "../include/evaluation.h"
 
-int history[2][4096];
-
 static int smallestAttackerSqr(const Board* b, const int sqr, const int col, const uint64_t diag, const uint64_t stra);
 __attribute__((hot)) static int see(Board* b, const int to, const int pieceAtSqr, const uint64_t diag, const uint64_t stra);
 
-#define NUM_KM 2
-
 static Move NOMOVE = (Move) {.from = -1, .to = -1};
 static int pVal[6];
-Move killerMoves[MAX_PLY][NUM_KM];
 
 Move counterMove[2][4096];
 
@@ -47,12 +42,12 @@ void initSort(void)
     pVal[5] = 116;
 }
 
-void initKM(void)
+void initKM(Heuristics* hs)
 {
     for (int i = 0; i < MAX_PLY; ++i)
     {
         for (int j = 0; j < NUM_KM; ++j)
-            killerMoves[i][j] = NOMOVE;
+            hs->killerMoves[i][j] = NOMOVE;
     }
 }
 
@@ -131,7 +126,7 @@ static int smallestAttackerSqr(const Board* b, const int sqr, const int col, con
 }
 
 //TODO: Set a flag to use SEE depending on the depth or sthng like that
-inline void assignScores(Board* b, Move* list, const int numMoves, const Move bestFromPos, const int depth)
+inline void assignScores(const Heuristics* hs, Board* b, Move* list, const int numMoves, const Move bestFromPos, const int depth)
 {
     Move* end = list + numMoves;
 
@@ -165,7 +160,7 @@ inline void assignScores(Board* b, Move* list, const int numMoves, const Move be
         {
             if (pawnAtt & (1ULL << curr->to))
                 curr->score -= 25 + 5*(PAWN - curr->piece);
-            int add = history[b->stm][BASE_64(curr->from, curr->to)];
+            int add = hs->history[b->stm][BASE_64(curr->from, curr->to)];
             if (add > 0)
                 add = (int)sqrt(add) / 2;
             else
@@ -179,9 +174,9 @@ inline void assignScores(Board* b, Move* list, const int numMoves, const Move be
         }
         else
         {
-            if (compMoves(&killerMoves[depth][0], curr))
+            if (compMoves(&hs->killerMoves[depth][0], curr))
                 curr->score += 59;
-            else if (compMoves(&killerMoves[depth][1], curr))
+            else if (compMoves(&hs->killerMoves[depth][1], curr))
                 curr->score += 58;
         }
         /*
@@ -210,31 +205,31 @@ inline void assignScoresQuiesce(Board* b, Move* list, const int numMoves)
         }
     }
 }
-inline void addKM(const Move m, const int depth)
+inline void addKM(Heuristics* hs, const Move m, const int depth)
 {
-    killerMoves[depth][0] = killerMoves[depth][1];
-    killerMoves[depth][1] = m;
+    hs->killerMoves[depth][0] = hs->killerMoves[depth][1];
+    hs->killerMoves[depth][1] = m;
 }
-inline void addHistory(const int from, const int to, const int n, const int stm)
+inline void addHistory(Heuristics* hs, const int from, const int to, const int n, const int stm)
 {
     assert(RANGE_64(from) && RANGE_64(to));
-    int* h = &history[stm][BASE_64(from, to)];
+    int* h = &hs->history[stm][BASE_64(from, to)];
     *h += n;
     if (*h > 7000)
         *h /= 10;
 }
-inline void decHistory(const int from, const int to, const int n, const int stm)
+inline void decHistory(Heuristics* hs, const int from, const int to, const int n, const int stm)
 {
     assert(RANGE_64(from) && RANGE_64(to));
-    int* h = &history[stm][BASE_64(from, to)];
+    int* h = &hs->history[stm][BASE_64(from, to)];
     *h -= n;
     if (*h < -7000)
         *h /= 10;
 }
-void initHistory(void)
+void initHistory(Heuristics* hs)
 {
-    int* end = history[0] + 4096;
-    for (int* p = history[BLACK], *q = history[WHITE]; p != end; ++p, ++q)
+    int* end = hs->history[0] + 4096;
+    for (int* p = hs->history[BLACK], *q = hs->history[WHITE]; p != end; ++p, ++q)
     {
         *p = 0;
         *q = 0;
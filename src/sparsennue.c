@@ -1,5 +1,3 @@
-#ifdef NNUE_SPARSE
-
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
@@ -10,18 +8,16 @@
 #include "../include/boardmoves.h"
 #include "../include/nnue.h"
 #include "../include/nnuearch.h"
+#include "../include/nnuesimd.h"
 
 //static const int dimensions[5] = {41024, 512, 32, 32, 1};
 
 #define mask_t int16_t
 
-static clipped_t clippedInput[kDimensionFT];
-static clipped_t hiddenLayer1[kDimensionHidden];
-static clipped_t hiddenLayer2[kDimensionHidden];
-
-const int getIdx(const int i, const int j, const int dim)
+//The input layer is stored by chunks of 4 inputs, see affineSparse
+const int getIdxSparse(const int i, const int j, const int dim)
 {
-    return j*kDimensionHidden+i;
+    return (j/4)*4*kDimensionHidden + i*4 + j%4;
 }
 
 static void propagateInput(const int16_t* __restrict__ input, const int stm,
@@ -30,52 +26,29 @@ static void propagateInput(const int16_t* __restrict__ input, const int stm,
 {
     assert(stm == 1 || stm == 0);
 
+    clipped_t clippedInput[kDimensionFT];
     int32_t tmp[kDimensionHidden];
-    for (int i = 0; i < kDimensionHidden; ++i)
-        tmp[i] = bs[i];
 
     const int offset = (1^stm)*kHalfDimensionFT;
     const int offset2 = kHalfDimensionFT ^ offset;
 
-    for (int i = 0; i < kDimensionFT; ++i)
-        clippedInput[i] = clip(input[i]);
-
-    int idx, ni;
-    for (int i = 0; i < kHalfDimensionFT; ++i)
-    {
-        idx = i + offset;
-        if (clippedInput[idx])
-            for (int j = 0; j < kDimensionHidden; ++j)
-                tmp[j] += clippedInput[idx]*ws[kDimensionHidden*i+j];
-
-        idx = i + offset2;
-        ni = i + kHalfDimensionFT;
-        if (clippedInput[idx])
-            for (int j = 0; j < kDimensionHidden; ++j)
-                tmp[j] += clippedInput[idx]*ws[kDimensionHidden*ni+j];
-    }
+    //The side to move goes first, like the rows of ws
+    clipAcc(input + offset, clippedInput, kHalfDimensionFT);
+    clipAcc(input + offset2, clippedInput + kHalfDimensionFT, kHalfDimensionFT);
 
-    for (unsigned i = 0; i < kDimensionHidden; i++)
-        nextLayer[i] = clip64(tmp[i]);
+    affineSparse(clippedInput, kDimensionFT, ws, bs, tmp);
+    clipHidden(tmp, nextLayer, kDimensionHidden);
 }
 
 static void propagate(const clipped_t* __restrict__ prevLayer, const int prevSize,
     clipped_t* __restrict__ nextLayer, const int nextSize,
     const weight_t* ws, const int32_t* bs)
 {
+    assert(nextSize == kDimensionHidden);
     int32_t tmp[kDimensionHidden];
-    for (int i = 0; i < kDimensionHidden; ++i)
-        tmp[i] = bs[i];
-
-    for (int i = 0; i < prevSize; ++i)
-    {
-        if (prevLayer[i])
-            for (int j = 0; j < kDimensionHidden; ++j)
-                tmp[j] += prevLayer[i]*ws[kDimensionHidden*i+j];
-    }
 
-    for (unsigned i = 0; i < kDimensionHidden; i++)
-        nextLayer[i] = clip64(tmp[i]);
+    affine(prevLayer, prevSize, ws, bs, tmp);
+    clipHidden(tmp, nextLayer, kDimensionHidden);
 }
 
 static int32_t output(const clipped_t* __restrict__ prevLayer,
@@ -87,39 +60,12 @@ static int32_t output(const clipped_t* __restrict__ prevLayer,
     return out;
 }
 
-int evaluate(const NNUE* nn, const Board* b, int16_t* nInput)
+/* Sparse version of the hidden layers, nn->weights1Sparse is stored by chunks
+ */
+int32_t forwardSparse(const NNUE* nn, const int16_t* nInput, const int stm, clipped_t* hidden1, clipped_t* hidden2)
 {
-    inputLayer(nn, b, WHITE, nInput);
-    inputLayer(nn, b, BLACK, nInput + kHalfDimensionFT);
-
-    propagateInput(nInput, b->stm, hiddenLayer1, nn->weights1, nn->biases1);
-    propagate(hiddenLayer1, dimensions[2], hiddenLayer2, dimensions[3], nn->weights2, nn->biases2);
-
-    int32_t out = output(hiddenLayer2, nn->outputW, *(nn->outputB));
-
-    return out / FV_SCALE;
-}
-
-//#define TEST_ACC
-
-#ifdef TEST_ACC
-static int32_t testInput[kDimensionFT];
-#endif
-int evaluateAcc(const NNUE* nn, const Board* const b, const int16_t* nInput)
-{
-    #ifdef TEST_ACC
-    inputLayer(nn, b, WHITE, testInput);
-    inputLayer(nn, b, BLACK, testInput+kHalfDimensionFT);
-
-    for (int i = 0; i < kDimensionFT; ++i)
-        assert(testInput[i] == nInput[i]);
-    #endif
-
-    propagateInput(nInput, b->stm, hiddenLayer1, nn->weights1, nn->biases1);
-    propagate(hiddenLayer1, dimensions[2], hiddenLayer2, dimensions[3], nn->weights2, nn->biases2);
-
-    const int32_t out = output(hiddenLayer2, nn->outputW, *(nn->outputB));
+    propagateInput(nInput, stm, hidden1, nn->weights1Sparse, nn->biases1);
+    propagate(hidden1, dimensions[2], hidden2, dimensions[3], nn->weights2, nn->biases2);
 
-    return out / FV_SCALE;
+    return output(hidden2, nn->outputW, *(nn->outputB));
 }
-#endif
\ No newline at end of file
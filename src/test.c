@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "../include/global.h"
 #include "../include/board.h"
@@ -15,8 +16,9 @@
 #include "../include/io.h"
 #include "../include/evaluation.h"
 #include "../include/hash.h"
-#include "../include/search.h"
+#include "../include/sort.h"
 #include "../include/nnue.h"
+#include "../include/search.h"
 #include "../include/perft.h"
 #ifdef USE_TB
 #include "../include/gaviota.h"
@@ -468,6 +470,89 @@ static void testNNUE(void)
     printf("NNUE updating works: %d\n", passes);
 }
 
+#define TT_STRESS_THREADS 8
+#define TT_STRESS_OPS 4000000
+#define TT_STRESS_KEYS 256
+
+typedef struct
+{
+    uint64_t seed;
+    long hits;
+    long mixed;
+} TTStressArgs;
+
+static inline uint64_t xorshift(uint64_t* s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+/* The top bits decide the cluster, so all the keys fall in 16 clusters
+ */
+static inline uint64_t stressKey(const uint64_t k)
+{
+    uint64_t mix = (k + 1) * 0x9e3779b97f4a7c15ULL;
+    return ((k & 15) << 60) | (mix >> 24);
+}
+static void* ttStress(void* _args)
+{
+    TTStressArgs* args = _args;
+    Eval e;
+
+    for (int i = 0; i < TT_STRESS_OPS; ++i)
+    {
+        const uint64_t r = xorshift(&args->seed);
+        const uint64_t hash = stressKey(r % TT_STRESS_KEYS);
+
+        //Every field is a function of the hash
+        const int val = (int)(hash & 0xfff) - 2048;
+        const int eval = (int)((hash >> 12) & 0xfff) - 2048;
+        const int depth = (hash >> 24) & 63;
+        const int flag = (hash >> 30) % 3;
+        const int from = (hash >> 35) & 63;
+        const Move m = (Move) {.piece = (hash >> 32) % 6, .from = from, .to = from ^ (1 + ((hash >> 41) & 31))};
+
+        if (r & (1ULL << 40))
+            storeTT(hash, m, val, eval, depth, flag);
+        else if (probeTT(hash, &e))
+        {
+            args->hits++;
+            if (e.val != val || e.eval != eval || e.depth != depth || e.flag != flag
+                || e.m.piece != m.piece || e.m.from != m.from || e.m.to != m.to)
+                args->mixed++;
+        }
+    }
+
+    return NULL;
+}
+/* Many threads store and probe the same few clusters at once,
+ * a probe must never return an entry made of different stores
+ */
+static void testTTConcurrency(void)
+{
+    pthread_t ids[TT_STRESS_THREADS];
+    TTStressArgs args[TT_STRESS_THREADS];
+    long hits = 0, mixed = 0;
+
+    resizeTable(2, 1);
+    for (int i = 0; i < TT_STRESS_THREADS; ++i)
+    {
+        args[i] = (TTStressArgs) {.seed = 0x2545f4914f6cdd1dULL * (i + 1), .hits = 0, .mixed = 0};
+        pthread_create(&ids[i], NULL, ttStress, &args[i]);
+    }
+    for (int i = 0; i < TT_STRESS_THREADS; ++i)
+    {
+        pthread_join(ids[i], NULL);
+        hits += args[i].hits;
+        mixed += args[i].mixed;
+    }
+    initializeTable();
+
+    printf("[+] TT probes with a hit: %ld\n", hits);
+    printf("TT is lockless safe: %d\n", mixed == 0 && hits > 0);
+}
+
 void chooseTest(const int mode)
 {
     switch (mode)
@@ -498,7 +583,10 @@ void chooseTest(const int mode)
         case 6:
             testNNUE();
             break;
+        case 7:
+            testTTConcurrency();
+            break;
         default:
-            printf("Choose mode [0..6]\n");
+            printf("Choose mode [0..7]\n");
     }
 }
\ No newline at end of file
@@ -14,9 +14,10 @@
 #include "../include/board.h"
 #include "../include/moves.h"
 #include "../include/hash.h"
+#include "../include/sort.h"
+#include "../include/nnue.h"
 #include "../include/search.h"
 #include "../include/evaluation.h"
-#include "../include/nnue.h"
 
 #define NUM_VARS 20
 
@@ -335,10 +336,11 @@ static void* mthError(void* _var)
 
     double localAcc = 0;
     Board b;
+    SearchThread td = (SearchThread) {.id = threadOffset};
     for (int i = 0; i < limit; ++i)
     {
         b = genFromFen(positions[num_thr*i+threadOffset].fen, &_ignore);
-        qv = qsearch(b, MINS_INF, PLUS_INF, 7);
+        qv = qsearch(&td, b, MINS_INF, PLUS_INF, 7, hashPosition(&b));
         adjustedQV = b.stm? qv : -qv;
         error = positions[num_thr*i+threadOffset].result - sigmoid(adjustedQV);
         localAcc += error * error;
@@ -355,6 +357,8 @@ static double error(void)
     assign = 0;
 
     setArray(vals);
+    initEval(); //The scores of the pieces are computed with the values
+    clearEvalCache(); //The cached evaluations used the previous values
     pthread_t thread_id[num_thr];
 
     //Launch the threads
@@ -7,28 +7,46 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "../include/global.h"
 #include "../include/board.h"
 #include "../include/moves.h"
 #include "../include/boardmoves.h"
 #include "../include/hash.h"
+#include "../include/sort.h"
+#include "../include/nnue.h"
 #include "../include/search.h"
 #include "../include/io.h"
 #include "../include/evaluation.h"
 #include "../include/uci.h"
 #include "../include/mate.h"
-#include "../include/nnue.h"
 #include "../include/perft.h"
 
 #define LEN 4096
 
+/* The search runs in its own thread so that stop and isready can be read meanwhile */
+typedef struct
+{
+    Board b;
+    Repetition rep;
+    SearchParams sp;
+} GoArgs;
+
+static pthread_t searchId;
+static int searching = 0;
+static GoArgs goArgs;
+
 static void uci(void);
 static void isready(void);
 static void perft_(Board b, int depth);
 static void mate_(Board b, int depth);
 static void eval_(Board b);
 static void go_(Board b, char* beg, Repetition* rep);
+static void setoption_(char* beg);
+static void stop_(void);
+static void waitSearch(void);
+static void bench_(int depth);
 static void help_(void);
 static int move_(Board* b, char* beg, Repetition* rep);
 static Board gen_(char* beg, Repetition* rep);
@@ -48,12 +66,30 @@ void loop(void)
     while(!quit)
     {
         res = fgets(input, LEN, stdin);
-        if (res == NULL) return;
+        if (res == NULL)
+        {
+            waitSearch();
+            return;
+        }
         beg = input;
 
+        //Only stop, ponderhit, isready, loadnnue and quit are processed while searching
+        if (strncmp(beg, "isready", 7) != 0
+            && strncmp(beg, "stop", 4) != 0
+            && strncmp(beg, "ponderhit", 9) != 0
+            && strncmp(beg, "loadnnue", 8) != 0
+            && strncmp(beg, "quit", 4) != 0)
+            waitSearch();
+
         if (strncmp(beg, "isready", 7) == 0)
             isready();
 
+        else if (strncmp(beg, "stop", 4) == 0)
+            stop_();
+
+        else if (strncmp(beg, "ponderhit", 9) == 0)
+            ponderHit();
+
         else if (strncmp(beg, "go", 2) == 0)
             go_(b, beg + 3, &rep);
 
@@ -66,11 +102,15 @@ void loop(void)
         else if(strncmp(beg, "position", 8) == 0)
             b = gen_(beg + 9, &rep);
 
+        else if (strncmp(beg, "setoption", 9) == 0)
+            setoption_(beg + 10);
+
         else if (strncmp(beg, "ucinewgame", 10) == 0)
         {
             b = defaultBoard();
             rep.hashTable[0] = hashPosition(&b);
             rep.index = 1;
+            reinitializeTable(getThreads());
         }
 
         else if (strncmp(beg, "uci", 3) == 0)
@@ -94,7 +134,23 @@ void loop(void)
             char* b = beg;
             while (*b != '\n') b++;
             *b = '\0';
-            initNNUE(beg + 9);
+            if (!initNNUE(NNUE_MAIN, beg + 9, NULL, 0))
+            {
+                fprintf(stdout, "info string Can't load the NNUE %s, keeping the current one\n", beg + 9);
+                fflush(stdout);
+            }
+            #else
+            fprintf(stderr, "USE_NNUE hasn't been defined, not using NNUE\n");
+            fflush(stderr);
+            #endif
+        }
+
+        else if (strncmp(beg, "nnuecheck", 9) == 0)
+        {
+            #ifdef USE_NNUE
+            const int positions = atoi(beg + 9);
+            const int passes = nnueSelfCheck(positions > 0? positions : 10000);
+            fprintf(stdout, "info string nnuecheck %s\n", passes? "passed" : "FAILED");
             #else
             fprintf(stderr, "USE_NNUE hasn't been defined, not using NNUE\n");
             fflush(stderr);
@@ -102,11 +158,27 @@ void loop(void)
         }
 
         else if (strncmp(beg, "quit", 4) == 0)
+        {
+            stop_();
             quit = 1;
+        }
 
         else if (strncmp(beg, "help", 4) == 0)
             help_();
 
+        else if (strncmp(beg, "bench nnue", 10) == 0)
+        {
+            #ifdef USE_NNUE
+            benchNNUE();
+            #else
+            fprintf(stderr, "USE_NNUE hasn't been defined, not using NNUE\n");
+            fflush(stderr);
+            #endif
+        }
+
+        else if (strncmp(beg, "bench", 5) == 0)
+            bench_(atoi(beg + 5));
+
         else
             fprintf(stdout, "# invalid command; type 'help'\n");
 
@@ -118,6 +190,18 @@ static void uci(void)
 {
     fprintf(stdout, "id name %s\n", ENGINE_NAME);
     fprintf(stdout, "id author %s\n", ENGINE_AUTHOR);
+    fprintf(stdout, "option name Threads type spin default 1 min 1 max %d\n", MAX_THREADS);
+    fprintf(stdout, "option name Hash type spin default %d min 1 max %d\n", DEFAULT_HASH, MAX_HASH);
+    fprintf(stdout, "option name EvalCache type spin default %d min 1 max %d\n", DEFAULT_EVAL_CACHE, MAX_EVAL_CACHE);
+    fprintf(stdout, "option name Ponder type check default false\n");
+    fprintf(stdout, "option name MultiPV type spin default 1 min 1 max %d\n", NMOVES);
+    #ifdef USE_NNUE
+    fprintf(stdout, "option name NNUEKernel type combo default auto var auto var regular var sparse\n");
+    fprintf(stdout, "option name EndgameNet type string default <empty>\n");
+    fprintf(stdout, "option name EndgamePieces type spin default 8 min 2 max 32\n");
+    fprintf(stdout, "option name LazyMargin type spin default %d min 0 max 10000\n", DEFAULT_LAZY_MARGIN);
+    fprintf(stdout, "option name ClassicalPieces type spin default %d min 0 max 32\n", DEFAULT_CLASSICAL_PIECES);
+    #endif
     fprintf(stdout, "uciok\n");
     fflush(stdout);
 }
@@ -149,16 +233,54 @@ static void eval_(Board b)
 {
     //TODO: Implement this once nn is in nnue.c
     #ifdef USE_NNUE
-    const int ev = evaluateNNUE(&b, 0);
+    const int ev = evaluateNNUE(&b, NULL);
     #else
     const int ev = eval(&b);
     #endif
     fprintf(stdout, "%d\n", ev);
     fflush(stdout);
 }
+static void* search_(void* _args)
+{
+    GoArgs* args = _args;
+    char mv[6] = "", pmv[6] = "";
+    Move best = bestTime(args->b, args->rep, args->sp);
+    Move ponder = ponderMove(best);
+
+    moveToText(best, mv);
+
+    if (ponder.from != -1)
+    {
+        moveToText(ponder, pmv);
+        fprintf(stdout, "bestmove %s ponder %s\n", mv, pmv);
+    }
+    else
+        fprintf(stdout, "bestmove %s\n", mv);
+    fflush(stdout);
+
+    return NULL;
+}
+/* Blocks until the current search (if any) finishes by itself
+ */
+static void waitSearch(void)
+{
+    if (searching)
+    {
+        pthread_join(searchId, NULL);
+        searching = 0;
+    }
+}
+static void stop_(void)
+{
+    if (searching)
+    {
+        setStop(1);
+        waitSearch();
+    }
+}
 static void go_(Board b, char* beg, Repetition* rep)
 {
-    SearchParams sp = {.depth = 0, .timeToMove = 0, .extraTime = 0};
+    SearchParams sp = {.depth = 0, .timeToMove = 0, .extraTime = 0, .ponder = 0, .infinite = 0};
     int wtime = 0, btime = 0, winc = 0, binc = 0, movestogo = 0;
 
     while (beg[1] != '\0' && beg[1] != '\n')
@@ -178,6 +300,13 @@ static void go_(Board b, char* beg, Repetition* rep)
         } else if (strncmp(beg, "movestogo", 9) == 0) {
             beg += 10;
             movestogo = atoi(beg);
+        } else if (strncmp(beg, "ponder", 6) == 0) {
+            beg += 6;
+            sp.ponder = 1;
+        } else if (strncmp(beg, "infinite", 8) == 0) {
+            beg += 8;
+            sp.depth = MAX_PLY;
+            sp.infinite = 1;
         } else if (strncmp(beg, "depth", 5) == 0) {
             beg += 6;
             sp.depth = atoi(beg);
@@ -190,9 +319,6 @@ static void go_(Board b, char* beg, Repetition* rep)
         ++beg;
     }
 
-    Move best;
-    char mv[6] = "";
-
     if (!sp.depth)
     {
         //Play with time
@@ -225,11 +351,103 @@ static void go_(Board b, char* beg, Repetition* rep)
 
     assert(sp.timeToMove >= 0);
     assert(sp.extraTime >= 0);
-    best = bestTime(b, *rep, sp);
 
-    moveToText(best, mv);
+    goArgs = (GoArgs) {.b = b, .rep = *rep, .sp = sp};
+    setStop(0);
+    searching = 1;
+    pthread_create(&searchId, NULL, search_, &goArgs);
+}
+/* setoption name <id> value <x>
+ */
+static void setoption_(char* beg)
+{
+    char* value = strstr(beg, "value ");
+    if (strncmp(beg, "name ", 5) != 0 || value == NULL)
+    {
+        fprintf(stdout, "# usage: setoption name <id> value <x>\n");
+        return;
+    }
+    beg += 5;
+    value += 6;
+
+    if (strncmp(beg, "Threads", 7) == 0)
+        setThreads(atoi(value));
+    else if (strncmp(beg, "Hash", 4) == 0)
+        resizeTable(atoi(value), getThreads());
+    else if (strncmp(beg, "EvalCache", 9) == 0)
+        resizeEvalCache(atoi(value));
+    else if (strncmp(beg, "MultiPV", 7) == 0)
+        setMultiPV(atoi(value));
+    else if (strncmp(beg, "Ponder", 6) == 0)
+        ; //Only tells if the GUI will send go ponder, nothing to change
+    #ifdef USE_NNUE
+    else if (strncmp(beg, "NNUEKernel", 10) == 0)
+    {
+        if (strncmp(value, "regular", 7) == 0)
+            setNNUEVariant(VARIANT_REGULAR);
+        else if (strncmp(value, "sparse", 6) == 0)
+            setNNUEVariant(VARIANT_SPARSE);
+        else
+            setNNUEVariant(VARIANT_AUTO);
+    }
+    else if (strncmp(beg, "EndgameNet", 10) == 0)
+    {
+        value[strcspn(value, "\r\n")] = '\0';
+        if (value[0] == '\0' || strcmp(value, "<empty>") == 0)
+            unloadNNUE(NNUE_ENDGAME);
+        else if (!initNNUE(NNUE_ENDGAME, value, NULL, 0))
+        {
+            fprintf(stdout, "info string Can't load the endgame NNUE %s, keeping the current one\n", value);
+            fflush(stdout);
+        }
+    }
+    else if (strncmp(beg, "EndgamePieces", 13) == 0)
+        setEndgamePieces(min(max(atoi(value), 2), 32));
+    else if (strncmp(beg, "LazyMargin", 10) == 0)
+        setLazyMargin(atoi(value));
+    else if (strncmp(beg, "ClassicalPieces", 15) == 0)
+        setClassicalPieces(atoi(value));
+    #endif
+    else
+        fprintf(stdout, "# unknown option\n");
+}
+/* Fixed positions searched at a fixed depth, the total of nodes is a signature of the search
+ * and the nps allows to compare builds (e.g. make release PREFETCH=no)
+ */
+static void bench_(int depth)
+{
+    static char fens[][100] = {
+        "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+        "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+        "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+        "r1bq1rk1/ppp2ppp/2np1n2/2b1p3/2B1P3/2PP1N2/PP3PPP/RNBQ1RK1 w - - 0 7",
+        "2r3k1/pp3ppp/8/3p4/3P4/2P2N2/P4PPP/4R1K1 w - - 0 1",
+        "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+        "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+        "8/5k2/3p4/1p1Pp2p/pP2Pp1P/P4P1K/8/8 b - - 99 50",
+    };
+    const int numFens = sizeof(fens) / sizeof(fens[0]);
+    int counter;
+    uint64_t nodes = 0;
+
+    if (depth <= 0)
+        depth = 10;
+
+    reinitializeTable(getThreads());
+    clock_t start = getTime();
+    for (int i = 0; i < numFens; ++i)
+    {
+        Board b = genFromFen(fens[i], &counter);
+        Repetition rep = (Repetition) {.hashTable = {hashPosition(&b)}, .index = 1};
+        bestTime(b, rep, (SearchParams) {.depth = depth});
+        nodes += totalNodes();
+    }
+    clock_t elapsed = 1000 * (getTime() - start) / CLOCKS_PER_SEC;
 
-    fprintf(stdout, "bestmove %s\n", mv);
+    fprintf(stdout, "===========================\n");
+    fprintf(stdout, "Total time (ms) : %lu\n", elapsed);
+    fprintf(stdout, "Nodes searched  : %lu\n", nodes);
+    fprintf(stdout, "Nodes/second    : %lu\n", 1000 * nodes / (elapsed + 1));
     fflush(stdout);
 }
 static int move_(Board* b, char* beg, Repetition* rep)
@@ -333,12 +551,25 @@ static Board gen_(char* beg, Repetition* rep)
     return b;
 }
 
-void infoString(const Move m, const int depth, const uint64_t nodes, const clock_t duration)
+/* multipv -> Index of the line (from 1), 0 when there is a single one
+ * stdout is locked so that the line isn't mixed with the output of the input loop
+ */
+void infoString(const PV* pv, const int score, const int depth, const uint64_t nodes, const clock_t duration, const int multipv)
 {
     char mv[6] = "";
-    moveToText(m, mv);
-    fprintf(stdout, "info score cp %d depth %d time %lu nodes %lu nps %lu pv %s\n", 
-        100 * m.score / V_PAWN[0], depth, duration, nodes, 1000 * nodes / (duration + 1), mv);
+    flockfile(stdout);
+    fprintf(stdout, "info ");
+    if (multipv)
+        fprintf(stdout, "multipv %d ", multipv);
+    fprintf(stdout, "score cp %d depth %d time %lu nodes %lu nps %lu pv", 
+        100 * score / V_PAWN[0], depth, duration, nodes, 1000 * nodes / (duration + 1));
+    for (int i = 0; i < pv->length; ++i)
+    {
+        moveToText(pv->moves[i], mv);
+        fprintf(stdout, " %s", mv);
+    }
+    fprintf(stdout, "\n");
+    funlockfile(stdout);
     fflush(stdout);
 }
 static void help_(void)
@@ -348,6 +579,18 @@ static void help_(void)
     fprintf(stdout, "uci.............Print uci info\n");
     fprintf(stdout, "ucinewgame......Load starting position\n");
     fprintf(stdout, "isready.........To ensure the engine is ready to receive commands\n");
+    fprintf(stdout, "stop............Stops the search and prints the best move\n");
+    fprintf(stdout, "ponderhit.......The expected move was played, keep searching with time\n");
+    fprintf(stdout, "setoption name <id> value <x>\n");
+    fprintf(stdout, "  Threads.......Number of search threads\n");
+    fprintf(stdout, "  Hash..........Size of the transposition table in MB\n");
+    fprintf(stdout, "  EvalCache.....Size of the cache of static evaluations in MB\n");
+    fprintf(stdout, "  MultiPV.......Number of root moves to report\n");
+    fprintf(stdout, "  NNUEKernel....auto, regular or sparse hidden layers, auto uses the fastest\n");
+    fprintf(stdout, "  EndgameNet....NNUE file for the positions with few pieces, <empty> to unload it\n");
+    fprintf(stdout, "  EndgamePieces.Positions with at most this many pieces use the EndgameNet\n");
+    fprintf(stdout, "  LazyMargin....Skip the NNUE in the qsearch when the material estimate is this far from the window, 0 disables it\n");
+    fprintf(stdout, "  ClassicalPieces.Searches with at most this many pieces and no EndgameNet use the classical evaluation, 0 disables it\n");
     fprintf(stdout, "eval............Static evaluation of loaded position\n");
     fprintf(stdout, "position\n");
     fprintf(stdout, "  startpos......Load starting position\n");
@@ -357,9 +600,14 @@ static void help_(void)
     fprintf(stdout, "perft #.........Count the number of legal positions at depth #\n");
     fprintf(stdout, "mate #..........Determine the shortest mate within # plies\n");
     fprintf(stdout, "loadnnue <path>.Load the NNUE file <path>\n");
+    fprintf(stdout, "bench [depth]...Search some positions and report the nodes and nps\n");
+    fprintf(stdout, "bench nnue......Time both NNUE variants, with NNUEKernel auto use the fastest\n");
+    fprintf(stdout, "nnuecheck [n]...Compare the vectorized NNUE kernels with the scalar ones in n positions\n");
     fprintf(stdout, "go\n");
     fprintf(stdout, "   depth #......Analyze at depth\n");
     fprintf(stdout, "   wtime #......Analyze until the time runs out\n");
+    fprintf(stdout, "   infinite.....Analyze until stop is received\n");
+    fprintf(stdout, "   ponder.......Analyze the expected reply until ponderhit or stop\n");
     fprintf(stdout, "quit............Exit the engine\n");
 
     fprintf(stdout, "\nExample of use:\n");